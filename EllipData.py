@@ -6,12 +6,43 @@ from datetime import datetime
 PORT = 'COM7'           # Change this to your ClearCore COM port (e.g., '/dev/ttyUSB0' on Linux/Mac)
 BAUD_RATE = 9600
 CSV_FILENAME = 'leveling_data_log.csv'
+SPECTRUM_FILENAME = 'vibration_spectrum_log.csv'   # SPEC lines from the vibration analysis
+CALIBRATION_FILENAME = 'psd_calibration.csv'       # CAL/CALROW lines, read by SerialData.py
+HOLD_FILENAME = 'motor_hold_log.csv'               # HOLD lines from the motor hold mode
 
 # === SETUP SERIAL AND CSV ===
 ser = serial.Serial(PORT, BAUD_RATE, timeout=1)
 
-with open(CSV_FILENAME, mode='w', newline='') as csvfile:
+with open(CSV_FILENAME, mode='w', newline='') as csvfile, \
+     open(SPECTRUM_FILENAME, mode='w', newline='') as spectrumfile, \
+     open(HOLD_FILENAME, mode='w', newline='') as holdfile:
     writer = csv.writer(csvfile)
+    spectrum_writer = csv.writer(spectrumfile)
+    hold_writer = csv.writer(holdfile)
+
+    # Motor hold CSV header, latencies only count wakes a correction waited for
+    hold_writer.writerow([
+        "PC_Timestamp",
+        "Device_Time_ms",
+        "Axis",
+        "Duty_permille",
+        "Wakes",
+        "CorrectionWakes",
+        "MeanLatency_us",
+        "MaxLatency_us",
+        "Timeouts"
+    ])
+
+    # Spectrum CSV header, followed by one amplitude column (uV) per bin pair
+    spectrum_writer.writerow([
+        "PC_Timestamp",
+        "Device_Time_ms",
+        "Axis",
+        "BinWidth_mHz",
+        "Notch1_mHz",
+        "Notch2_mHz",
+        "Amplitudes_uV..."
+    ])
 
     # CSV header
     writer.writerow([
@@ -25,6 +56,7 @@ with open(CSV_FILENAME, mode='w', newline='') as csvfile:
     ])
 
     print(f"Logging data from {PORT} to '{CSV_FILENAME}'... Press Ctrl+C to stop.\n")
+    calibration_lines = []
 
     try:
         while True:
@@ -35,6 +67,38 @@ with open(CSV_FILENAME, mode='w', newline='') as csvfile:
 
             try:
                 parts = line.split(',')
+
+                # Vibration spectrum: SPEC,Time_ms,Axis,BinWidth_mHz,Notch1_mHz,Notch2_mHz,A0,A1,...
+                if parts[0] == "SPEC":
+                    spectrum_writer.writerow([datetime.now().isoformat()] + parts[1:])
+                    print(f"Spectrum {parts[2]}: notches at {parts[4]} / {parts[5]} mHz")
+                    continue
+
+                # Motor hold: HOLD,Time_ms,Axis,Duty_permille,Wakes,CorrectionWakes,MeanLatency_us,MaxLatency_us,Timeouts
+                if parts[0] == "HOLD":
+                    hold_writer.writerow([datetime.now().isoformat()] + parts[1:])
+                    print(f"Motor {parts[2]} hold: {int(parts[3]) / 10:.1f}% energized, "
+                          f"{parts[5]} corrections waited {parts[6]} us on average, "
+                          f"{parts[8]} wakes timed out")
+                    continue
+
+                # Leveling regime change: MODE,Time_ms,Regime,DriftRate_uV_per_s
+                if parts[0] == "MODE":
+                    print(f"Leveling regime {parts[2]} at {parts[1]} ms (drift {parts[3]} uV/s)")
+                    continue
+
+                # PSD calibration map: CAL header then one CALROW per map row, sent at power up
+                if parts[0] in ("CAL", "CALROW"):
+                    if parts[0] == "CAL":
+                        calibration_lines = [line]
+                        print(f"PSD calibration: {','.join(parts[1:])}")
+                    elif calibration_lines:
+                        calibration_lines.append(line)
+                    if len(calibration_lines) > 1 and len(calibration_lines) == int(calibration_lines[0].split(',')[1]) + 1:
+                        with open(CALIBRATION_FILENAME, mode='w') as calfile:
+                            calfile.write('\n'.join(calibration_lines) + '\n')
+                    continue
+
                 if len(parts) != 6:
                     print(f"⚠️ Invalid line: {line}")
                     continue
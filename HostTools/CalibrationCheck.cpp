@@ -0,0 +1,180 @@
+/*==========================================================
+; File Name: CalibrationCheck.cpp
+;
+; Description:
+; Host check of the PSD calibration map. A raster is taken from a known
+; sensor model with the axes rotated against the stage and a cubic
+; nonlinearity, the map is built from it the same way as on the
+; ClearCore, and then:
+;  - every lookup over the calibrated area must land within
+;    maxLookupError steps of the true stage position,
+;  - Correction must move both axes back toward the level position, with
+;    the model both ways round for the Y axis,
+;  - Load must accept the stored map and give the same map back, and
+;    reject stored maps that are corrupted or erased.
+; The program exits with 1 if any check fails.
+;
+; Usage:
+;    CalibrationCheck
+;
+;========================================================== */
+
+#include "../PsdCalibration.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Sensor model: axes rotated against the stage, and the spot position
+// compressed by the cubic term toward the edge of the raster
+const double rotationDegrees = 3.0;
+const double cubic = 0.05;                // compression at the raster edge
+const double uPerStep = 2E-4 / 3.17;      // deltaX at a SUM of 3.17V
+const double rasterEdge = (calGridSize / 2) * calStepSpacing;
+const double sumVoltage = 3.17;
+// Lookups are checked over this much of the raster, in steps from center
+const double checkedEdge = 4000;
+// Largest allowed lookup error in steps
+const double maxLookupError = 60;
+
+
+/*------------------------------------------------------------------------------
+ * SensorModel
+ *
+ *    Normalized spot position for a stage position in steps. ySign is the
+ *    direction v moves for a positive Y step.
+ -----------------------------------------------------------------------------*/
+static void SensorModel(double sx, double sy, double ySign, double &u, double &v) {
+    double angle = rotationDegrees * M_PI / 180.0;
+    double rx = cos(angle) * sx - sin(angle) * sy;
+    double ry = sin(angle) * sx + cos(angle) * sy;
+    double cx = rx / rasterEdge, cy = ry / rasterEdge;
+    u = uPerStep * rx * (1 - cubic * cx * cx);
+    v = ySign * uPerStep * ry * (1 - cubic * cy * cy);
+}
+
+static bool BuildModelMap(double ySign, PsdCalibration &calibration) {
+    CalibrationRaster raster;
+    for (int j = 0; j < calGridSize; j++) {
+        for (int i = 0; i < calGridSize; i++) {
+            double u, v;
+            SensorModel((i - calGridSize / 2) * calStepSpacing, (j - calGridSize / 2) * calStepSpacing,
+                        ySign, u, v);
+            raster.u[j][i] = (float)u;
+            raster.v[j][i] = (float)v;
+        }
+    }
+    return calibration.Build(raster);
+}
+
+/*------------------------------------------------------------------------------
+ * CheckLookup
+ *
+ *    Looks up the model spot position on a fine grid of stage positions and
+ *    checks the worst distance from the true position.
+ -----------------------------------------------------------------------------*/
+static bool CheckLookup(const PsdCalibration &calibration, double ySign) {
+    double worst = 0, worstX = 0, worstY = 0;
+    for (double sy = -checkedEdge; sy <= checkedEdge; sy += 100) {
+        for (double sx = -checkedEdge; sx <= checkedEdge; sx += 100) {
+            double u, v;
+            float stepsX, stepsY;
+            SensorModel(sx, sy, ySign, u, v);
+            calibration.Lookup((float)u, (float)v, stepsX, stepsY);
+            double error = fmax(fabs(stepsX - sx), fabs(stepsY - sy));
+            if (error > worst) {
+                worst = error;
+                worstX = sx;
+                worstY = sy;
+            }
+        }
+    }
+    bool passed = worst <= maxLookupError;
+    printf("  lookup: worst error %.1f steps at (%.0f, %.0f), limit %.0f  %s\n",
+           worst, worstX, worstY, maxLookupError, passed ? "ok" : "FAIL");
+    return passed;
+}
+
+/*------------------------------------------------------------------------------
+ * CheckCorrection
+ *
+ *    Levels at the raster center and offsets the stage along each axis in
+ *    both directions. The correction must move each axis against its
+ *    offset and leave the spot within maxLookupError steps of level.
+ -----------------------------------------------------------------------------*/
+static bool CheckCorrection(const PsdCalibration &calibration, double ySign) {
+    const double offsets[4][2] = {{2000, 0}, {-2000, 0}, {0, 2000}, {0, -2000}};
+    double levelU, levelV;
+    SensorModel(0, 0, ySign, levelU, levelV);
+    double levelX = 5.0 + levelU * sumVoltage, levelY = 5.0 + levelV * sumVoltage;
+    bool passed = true;
+
+    for (int k = 0; k < 4; k++) {
+        double u, v;
+        int32_t stepsX, stepsY;
+        SensorModel(offsets[k][0], offsets[k][1], ySign, u, v);
+        calibration.Correction(5.0 + u * sumVoltage, 5.0 + v * sumVoltage, levelX, levelY,
+                               sumVoltage, stepsX, stepsY);
+        double remainingX = offsets[k][0] + stepsX, remainingY = offsets[k][1] + stepsY;
+        bool signs = (offsets[k][0] == 0 || (stepsX < 0) == (offsets[k][0] > 0)) &&
+                     (offsets[k][1] == 0 || (stepsY < 0) == (offsets[k][1] > 0));
+        bool level = fabs(remainingX) <= maxLookupError && fabs(remainingY) <= maxLookupError;
+        printf("  correction from (%5.0f, %5.0f): steps (%5d, %5d)  %s\n", offsets[k][0],
+               offsets[k][1], (int)stepsX, (int)stepsY, signs && level ? "ok" : "FAIL");
+        passed = passed && signs && level;
+    }
+    return passed;
+}
+
+/*------------------------------------------------------------------------------
+ * CheckStorage
+ *
+ *    The stored map must load back to the same map, and a map with any
+ *    single bit flipped or read from erased NVM must be rejected.
+ -----------------------------------------------------------------------------*/
+static bool CheckStorage(const PsdCalibration &calibration) {
+    PsdCalibration loaded;
+    bool roundTrip = loaded.Load(calibration.Stored()) &&
+                     !memcmp(&loaded.Data(), &calibration.Data(), sizeof(PsdCalibrationData)) &&
+                     !memcmp(&loaded.Stored(), &calibration.Stored(), sizeof(PsdCalibrationStore));
+    printf("  storage: round trip  %s\n", roundTrip ? "ok" : "FAIL");
+
+    int accepted = 0;
+    for (unsigned bit = 0; bit < 8 * sizeof(PsdCalibrationStore); bit++) {
+        PsdCalibrationStore corrupted = calibration.Stored();
+        ((uint8_t *)&corrupted)[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+        if (loaded.Load(corrupted) || loaded.Valid()) {
+            accepted++;
+        }
+    }
+    PsdCalibrationStore erased;
+    memset(&erased, 0xFF, sizeof(erased));
+    accepted += loaded.Load(erased);
+    memset(&erased, 0x00, sizeof(erased));
+    accepted += loaded.Load(erased);
+    printf("  storage: %d corrupted or erased maps accepted  %s\n", accepted, accepted ? "FAIL" : "ok");
+    return roundTrip && accepted == 0;
+}
+
+
+int main() {
+    bool passed = true;
+    const double ySigns[2] = {1.0, -1.0};
+
+    for (int s = 0; s < 2; s++) {
+        PsdCalibration calibration;
+        printf("Sensor rotated %.1f deg, %.0f%% cubic, v %s with Y steps\n", rotationDegrees,
+               cubic * 100, ySigns[s] > 0 ? "increasing" : "decreasing");
+        if (!BuildModelMap(ySigns[s], calibration)) {
+            printf("  build  FAIL\n");
+            passed = false;
+            continue;
+        }
+        passed = CheckLookup(calibration, ySigns[s]) && passed;
+        passed = CheckCorrection(calibration, ySigns[s]) && passed;
+        passed = CheckStorage(calibration) && passed;
+    }
+
+    printf("\n%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,549 @@
+/*==========================================================
+; File Name: ControlBench.cpp
+;
+; Description:
+; Host microbenchmarks for the per-sample leveling code. Each kernel
+; (ADC conversion, averaging, tolerance and step math, notch filters,
+; FFT, calibration lookup, gain schedule and telemetry formatting) is
+; run over the recorded serial logs and timed in ns per call. The time
+; is also scaled by how often the firmware calls the kernel to give the
+; load in microseconds of host CPU per second of leveling.
+;
+; Each kernel is also timed relative to a fixed reference kernel run in
+; the same rounds, so the comparison does not depend on how fast the host
+; is. Results are compared against a baseline file of these relative
+; times and the program exits with 1 if any kernel is more than
+; --threshold percent slower relative to the reference, or allocates
+; more than it did. Use --update to write a new baseline.
+;
+; Usage:
+;    ControlBench [--baseline FILE] [--threshold PCT] [--update] LOG.csv...
+;
+;========================================================== */
+
+#include "TraceReader.h"
+#include "../LevelingMath.h"
+#include "../VibrationAnalysis.h"
+#include "../PsdCalibration.h"
+#include "../LevelingSchedule.h"
+#include "../Telemetry.h"
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <math.h>
+#include <new>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Firmware values the kernels are run with
+const int adcResolution = 12;
+const int numSamples = 10;
+const double loopRate = 1000.0 / 75;            // readings per second
+const double averageRate = loopRate / numSamples; // leveling decisions per second
+const double tolerance = 1.5E-2;
+const double voltsPerStep = 2E-4;
+const int reportWindows = 8;                     // SPECTRUM_REPORT_WINDOWS
+// Raw samples replayed per averaged reading (0.75s at the vibration rate)
+const int rawPerReading = (int)(vibrationSampleRate * numSamples / loopRate);
+const size_t maxRawSamples = 1 << 20;
+
+// Timing: "rounds" runs of at least minRunNs each. Every round runs each
+// kernel once, right after a run of the reference kernel, so the runs of a
+// kernel are spread over the whole benchmark. ns/call is the best run, and
+// the relative time is the best run of the kernel over the best run of the
+// reference. A busy host makes runs slower, not faster, and the reference
+// gets a run before every kernel, so its best run is steady.
+const int rounds = 60;
+const double minRunNs = 1E6;
+// Kernels over the threshold are timed for this many more rounds before
+// failing, after a pause that doubles each pass, so they only fail if no
+// run over about half a minute gets close to the baseline. A busy host can
+// slow some kernels for tens of seconds. A baseline update uses 3x the
+// rounds.
+const int confirmPasses = 4;
+const int confirmPauseMs = 2000;
+
+
+/*------------------------------------------------------------------------------
+ * Allocation counting
+ *
+ *    Every operator new in the process is counted so kernels that allocate
+ *    on the per-sample path show up in the report.
+ -----------------------------------------------------------------------------*/
+static unsigned long long allocationCount = 0;
+
+void *operator new(size_t size) {
+    allocationCount++;
+    void *memory = malloc(size ? size : 1);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+    free(memory);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Bench input
+ *
+ *    The recorded logs in the forms each kernel needs.
+ -----------------------------------------------------------------------------*/
+struct AdcReading {
+    int16_t x, y, sum;
+};
+
+struct BenchInput {
+    std::vector<TraceSample> averaged; // leveling decisions
+    std::vector<AdcReading> readings;  // one per loop pass
+    std::vector<int16_t> raw;          // raw X samples at the vibration rate
+    PsdCalibration calibration;
+    VibrationChannel notched;          // notches tuned to the raw samples
+};
+
+static int16_t VoltageToAdc(double voltage) {
+    return (int16_t)lround(voltage * ((1 << adcResolution) - 1) / 10.0);
+}
+
+/*------------------------------------------------------------------------------
+ * PrepareInput
+ *
+ *    Each averaged reading is expanded into numSamples loop readings and
+ *    rawPerReading raw samples. The raw samples get a 31Hz and 47Hz
+ *    vibration added so the filters and peak search do real work. A linear
+ *    calibration map matching deltaX/deltaY is built for the lookup kernel.
+ -----------------------------------------------------------------------------*/
+static void PrepareInput(const std::vector<Trace> &traces, BenchInput &input) {
+    for (size_t t = 0; t < traces.size(); t++) {
+        const std::vector<TraceSample> &samples = traces[t].samples;
+        input.averaged.insert(input.averaged.end(), samples.begin(), samples.end());
+    }
+
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        const TraceSample &sample = input.averaged[i];
+        AdcReading reading = {VoltageToAdc(sample.inputX), VoltageToAdc(sample.inputY),
+                              VoltageToAdc(sample.inputSum)};
+        input.readings.insert(input.readings.end(), numSamples, reading);
+
+        for (int k = 0; k < rawPerReading && input.raw.size() < maxRawSamples; k++) {
+            double time = input.raw.size() / vibrationSampleRate;
+            double vibration = 4.0 * sin(2 * M_PI * 31.0 * time) + 2.0 * sin(2 * M_PI * 47.0 * time);
+            input.raw.push_back((int16_t)(reading.x + lround(vibration)));
+        }
+    }
+
+    CalibrationRaster raster;
+    for (int j = 0; j < calGridSize; j++) {
+        for (int i = 0; i < calGridSize; i++) {
+            double stepsX = (i - calGridSize / 2) * calStepSpacing;
+            double stepsY = (j - calGridSize / 2) * calStepSpacing;
+            raster.u[j][i] = (float)(stepsX * voltsPerStep / 3.17);
+            raster.v[j][i] = (float)(-stepsY * voltsPerStep / 3.17);
+        }
+    }
+    input.calibration.Build(raster);
+
+    input.notched.Init(10.0f / ((1 << adcResolution) - 1));
+    for (size_t i = 0; i < input.raw.size() && i < (size_t)fftSize * 8; i++) {
+        input.notched.Update(input.raw[i]);
+        if (input.notched.WindowReady()) {
+            input.notched.Analyze();
+        }
+    }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Kernels
+ *
+ *    Each kernel makes one pass over its input and returns the number of
+ *    calls made. Results are added to "sink" so nothing is optimized away.
+ -----------------------------------------------------------------------------*/
+static volatile double sink;
+
+/*------------------------------------------------------------------------------
+ * ReferenceKernel
+ *
+ *    Fixed work that does not use firmware code, the other kernels are timed
+ *    relative to it. It is a dependent chain of integer and floating point
+ *    multiply-adds kept in registers, so its time follows the speed of the
+ *    core and not the state of the caches or branch predictors, which a
+ *    busy host disturbs for seconds at a time.
+ -----------------------------------------------------------------------------*/
+static size_t ReferenceKernel(BenchInput &input) {
+    uint32_t state = 12345;
+    double value = 1.0;
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        for (int k = 0; k < 8; k++) {
+            state = state * 1664525u + 1013904223u;
+            value = value * 0.999 + 1E-3 * (state >> 24);
+        }
+    }
+    sink = value + state;
+    return input.averaged.size();
+}
+
+static size_t AdcToVoltageKernel(BenchInput &input) {
+    double total = 0;
+    for (size_t i = 0; i < input.readings.size(); i++) {
+        const AdcReading &reading = input.readings[i];
+        total += AdcToVoltage(reading.sum, adcResolution);
+        total += AdcToVoltage(reading.y, adcResolution);
+        total += AdcToVoltage(reading.x, adcResolution);
+    }
+    sink = total;
+    return input.readings.size();
+}
+
+static size_t BoxcarAverageKernel(BenchInput &input) {
+    VoltageAverage average;
+    double total = 0, x, y, sum;
+    int count = 0;
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        const TraceSample &sample = input.averaged[i];
+        average.Add(sample.inputX, sample.inputY, sample.inputSum);
+        if (++count == numSamples) {
+            average.Take(numSamples, x, y, sum);
+            total += x + y + sum;
+            count = 0;
+        }
+    }
+    sink = total;
+    return input.averaged.size();
+}
+
+static size_t ToleranceStepsKernel(BenchInput &input) {
+    int32_t total = 0;
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        const TraceSample &sample = input.averaged[i];
+        if (OutOfTolerance(sample.inputX, sample.levelX, tolerance)) {
+            total += LinearSteps(sample.levelX - sample.inputX, voltsPerStep);
+        }
+        if (OutOfTolerance(sample.inputY, sample.levelY, tolerance)) {
+            total += LinearSteps(sample.inputY - sample.levelY, voltsPerStep);
+        }
+    }
+    sink = total;
+    return input.averaged.size();
+}
+
+static size_t CalibrationKernel(BenchInput &input) {
+    int32_t total = 0, stepsX, stepsY;
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        const TraceSample &sample = input.averaged[i];
+        input.calibration.Correction(sample.inputX, sample.inputY, sample.levelX, sample.levelY,
+                                     sample.inputSum, stepsX, stepsY);
+        total += stepsX + stepsY;
+    }
+    sink = total;
+    return input.averaged.size();
+}
+
+static size_t ScheduleUpdateKernel(BenchInput &input) {
+    // The logs are concatenated, so the readings get evenly spaced times
+    const double msPerReading = 1000.0 / averageRate;
+    LevelingSchedule schedule;
+    schedule.Reset(0);
+    double total = 0;
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        const TraceSample &sample = input.averaged[i];
+        if (schedule.Update((uint32_t)(i * msPerReading), sample.inputX - sample.levelX,
+                            sample.inputY - sample.levelY)) {
+            total += 1;
+        }
+        total += schedule.DriftRate();
+    }
+    sink = total;
+    return input.averaged.size();
+}
+
+static size_t RegimeMoveKernel(BenchInput &input) {
+    int32_t total = 0;
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        const TraceSample &sample = input.averaged[i];
+        LevelingMove move = RegimeMove(coarseRegime, input.calibration, sample.levelX, sample.levelY,
+                                       sample.inputX, sample.inputY, sample.inputSum);
+        total += move.stepsX + move.stepsY;
+    }
+    sink = total;
+    return input.averaged.size();
+}
+
+static size_t NotchFilterKernel(BenchInput &input) {
+    double total = 0;
+    for (size_t i = 0; i < input.raw.size(); i++) {
+        total += input.notched.Update(input.raw[i]);
+    }
+    input.notched.Restart();
+    sink = total;
+    return input.raw.size();
+}
+
+static size_t FftWindowKernel(BenchInput &input) {
+    static VibrationChannel channel;
+    static bool initialized = false;
+    if (!initialized) {
+        channel.Init(10.0f / ((1 << adcResolution) - 1));
+        initialized = true;
+    }
+    size_t windows = 0;
+    for (size_t i = 0; i < input.raw.size(); i++) {
+        channel.Update(input.raw[i]);
+        if (channel.WindowReady()) {
+            channel.Analyze();
+            windows++;
+        }
+    }
+    sink = channel.Output();
+    return windows;
+}
+
+static size_t SampleTelemetryKernel(BenchInput &input) {
+    char line[telemetryLineSize];
+    size_t total = 0;
+    for (size_t i = 0; i < input.averaged.size(); i++) {
+        const TraceSample &sample = input.averaged[i];
+        total += FormatSampleLine(line, telemetryLineSize, sample.timeMs, sample.levelX, sample.levelY,
+                                  sample.inputX, sample.inputY, sample.inputSum);
+    }
+    sink = (double)total;
+    return input.averaged.size();
+}
+
+static size_t SpectrumTelemetryKernel(BenchInput &input) {
+    const size_t calls = 200;
+    char line[telemetryLineSize];
+    size_t total = 0;
+    for (size_t i = 0; i < calls; i++) {
+        total += FormatSpectrumLine(line, telemetryLineSize, (uint32_t)i, 'X', input.notched);
+    }
+    sink = (double)total;
+    return calls;
+}
+
+struct Kernel {
+    const char *name;
+    size_t (*run)(BenchInput &input);
+    double callsPerSecond; // how often the firmware runs it while leveling
+};
+
+// The reference kernel is first, it is not part of the firmware load
+static const Kernel kernels[] = {
+    {"reference", ReferenceKernel, 0},
+    {"adc_to_voltage", AdcToVoltageKernel, loopRate},
+    {"boxcar_average", BoxcarAverageKernel, loopRate},
+    {"tolerance_steps", ToleranceStepsKernel, averageRate},
+    {"calibration_lookup", CalibrationKernel, averageRate},
+    {"schedule_update", ScheduleUpdateKernel, averageRate},
+    {"regime_move", RegimeMoveKernel, averageRate},
+    {"notch_filter", NotchFilterKernel, 2 * vibrationSampleRate},
+    {"fft_window", FftWindowKernel, 2 * vibrationSampleRate / fftSize},
+    {"sample_telemetry", SampleTelemetryKernel, averageRate},
+    {"spectrum_telemetry", SpectrumTelemetryKernel, 2 * vibrationSampleRate / fftSize / reportWindows},
+};
+const int kernelCount = sizeof(kernels) / sizeof(kernels[0]);
+
+
+struct Result {
+    double nsPerCall;
+    double relative; // best run relative to the best run of the reference kernel
+    double allocsPerCall;
+};
+
+/*------------------------------------------------------------------------------
+ * Measure
+ *
+ *    Times one run of a kernel and keeps the fastest time seen in "result".
+ *    Allocations are the most seen in any run.
+ *
+ * Returns: ns per call of this run
+ -----------------------------------------------------------------------------*/
+static double Measure(const Kernel &kernel, BenchInput &input, Result &result) {
+    typedef std::chrono::steady_clock Clock;
+    size_t calls = 0;
+    unsigned long long allocations = allocationCount;
+    Clock::time_point start = Clock::now();
+    double elapsed;
+    do {
+        calls += kernel.run(input);
+        elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    } while (elapsed < minRunNs);
+
+    double nsPerCall = elapsed / calls;
+    double allocsPerCall = (double)(allocationCount - allocations) / calls;
+    if (nsPerCall < result.nsPerCall) {
+        result.nsPerCall = nsPerCall;
+    }
+    if (allocsPerCall > result.allocsPerCall) {
+        result.allocsPerCall = allocsPerCall;
+    }
+    return nsPerCall;
+}
+
+/*------------------------------------------------------------------------------
+ * MeasureRounds
+ *
+ *    Runs "count" rounds of the kernels marked in "selected", each one right
+ *    after a run of the reference kernel (kernels[0]), and updates the
+ *    relative times of all kernels from the best runs.
+ -----------------------------------------------------------------------------*/
+static void MeasureRounds(const bool *selected, int count, BenchInput &input, Result *results) {
+    for (int round = 0; round < count; round++) {
+        for (int i = 1; i < kernelCount; i++) {
+            if (selected[i]) {
+                Measure(kernels[0], input, results[0]);
+                Measure(kernels[i], input, results[i]);
+            }
+        }
+    }
+    for (int i = 0; i < kernelCount; i++) {
+        results[i].relative = results[i].nsPerCall / results[0].nsPerCall;
+    }
+}
+
+// Baseline file lines are "kernel relative_time allocs_per_call", # starts a comment
+static std::map<std::string, Result> ReadBaseline(const std::string &path) {
+    std::map<std::string, Result> baseline;
+    std::ifstream file(path.c_str());
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::stringstream stream(line);
+        std::string name;
+        Result result;
+        result.nsPerCall = 0;
+        if (stream >> name >> result.relative >> result.allocsPerCall) {
+            baseline[name] = result;
+        }
+    }
+    return baseline;
+}
+
+static bool WriteBaseline(const std::string &path, const Result *results) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "# ControlBench baseline: kernel relative_time allocs_per_call\n");
+    fprintf(file, "# Times are relative to the reference kernel, so the file does not\n");
+    fprintf(file, "# depend on the host. Regenerate with: make -C HostTools bench-baseline\n");
+    for (int i = 0; i < kernelCount; i++) {
+        fprintf(file, "%s %.4f %.3f\n", kernels[i].name, results[i].relative, results[i].allocsPerCall);
+    }
+    fclose(file);
+    return true;
+}
+
+
+int main(int argc, char **argv) {
+    std::string baselinePath = "bench_baseline.txt";
+    double threshold = 20.0;
+    bool update = false;
+    std::vector<Trace> traces;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+            baselinePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--update")) {
+            update = true;
+        }
+        else {
+            Trace trace;
+            if (!ReadTrace(argv[i], trace)) {
+                fprintf(stderr, "Could not read %s\n", argv[i]);
+                return 2;
+            }
+            traces.push_back(trace);
+        }
+    }
+    if (traces.empty()) {
+        fprintf(stderr, "Usage: %s [--baseline FILE] [--threshold PCT] [--update] LOG.csv...\n", argv[0]);
+        return 2;
+    }
+
+    BenchInput input;
+    PrepareInput(traces, input);
+    printf("%zu logs, %zu averaged readings, %zu raw samples\n\n",
+           traces.size(), input.averaged.size(), input.raw.size());
+
+    std::map<std::string, Result> baseline = ReadBaseline(baselinePath);
+    Result results[kernelCount];
+    bool failed = false;
+    double totalLoad = 0;
+
+    for (int i = 0; i < kernelCount; i++) {
+        results[i].nsPerCall = 1E30;
+        results[i].allocsPerCall = 0;
+        kernels[i].run(input); // warm up
+    }
+    bool selected[kernelCount];
+    for (int i = 0; i < kernelCount; i++) {
+        selected[i] = true;
+    }
+    MeasureRounds(selected, update ? 3 * rounds : rounds, input, results);
+    for (int pass = 0; pass < confirmPasses && !update; pass++) {
+        bool retimed = false;
+        for (int i = 1; i < kernelCount; i++) {
+            std::map<std::string, Result>::const_iterator base = baseline.find(kernels[i].name);
+            selected[i] = base != baseline.end() &&
+                          results[i].relative > base->second.relative * (1.0 + threshold / 100.0);
+            retimed = retimed || selected[i];
+        }
+        if (!retimed) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(confirmPauseMs << pass));
+        MeasureRounds(selected, rounds, input, results);
+    }
+
+    printf("%-20s %10s %10s %10s %12s %8s %10s %8s\n",
+           "kernel", "ns/call", "relative", "calls/s", "us/s load", "alloc", "baseline", "change");
+    for (int i = 0; i < kernelCount; i++) {
+        double load = results[i].nsPerCall * kernels[i].callsPerSecond / 1000.0;
+        totalLoad += load;
+        printf("%-20s %10.2f %10.4f %10.2f %12.3f %8.3f", kernels[i].name, results[i].nsPerCall,
+               results[i].relative, kernels[i].callsPerSecond, load, results[i].allocsPerCall);
+
+        std::map<std::string, Result>::const_iterator base = baseline.find(kernels[i].name);
+        if (update || base == baseline.end()) {
+            printf(" %10s %8s\n", "-", update ? "" : "new");
+            continue;
+        }
+        double change = 100.0 * (results[i].relative / base->second.relative - 1.0);
+        bool slower = change > threshold;
+        bool allocates = results[i].allocsPerCall > base->second.allocsPerCall;
+        printf(" %10.4f %+7.1f%%%s\n", base->second.relative, change,
+               slower ? "  FAIL slower" : allocates ? "  FAIL allocates" : "");
+        failed = failed || slower || allocates;
+    }
+    printf("\nTotal load at firmware call rates: %.3f us per second\n", totalLoad);
+
+    if (update) {
+        if (!WriteBaseline(baselinePath, results)) {
+            fprintf(stderr, "Could not write %s\n", baselinePath.c_str());
+            return 2;
+        }
+        printf("Baseline written to %s\n", baselinePath.c_str());
+        return 0;
+    }
+    printf("%s (threshold %.0f%%)\n", failed ? "FAIL" : "PASS", threshold);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,508 @@
+/*==========================================================
+; File Name: LevelingReplay.cpp
+;
+; Description:
+; Closed loop replay of the recorded serial logs. Each log is turned into
+; a plant: the step gain of each axis is fitted from the moves the
+; recording firmware made, and those moves are taken back out of the
+; readings to get the drift of the sample on its own. The leveling code
+; (averaging, LevelingSchedule and RegimeMove) is then run against that
+; drift at the firmware loop rate, and the spot position it would have
+; held is scored the same way as SerialData.py: distance from the level
+; position in mm (mean, std, max and % within 0.04 mm), plus the number
+; of moves and total steps.
+;
+; Each log is replayed twice, once with gain scheduling and once with the
+; fixed regime (GAIN_SCHEDULING off); --scheduled or --fixed runs only
+; one of them. The replay is deterministic. Runs are done in parallel, one
+; thread each, and the results are compared against a baseline file. The
+; program exits with 1 if any metric of any run is worse than the
+; baseline or a run has no baseline. Use --update to write the runs into
+; the baseline, other rows in it are kept.
+;
+; Usage:
+;    LevelingReplay [--baseline FILE] [--update] [--scheduled | --fixed] LOG.csv...
+;
+;========================================================== */
+
+#include "TraceReader.h"
+#include "../LevelingMath.h"
+#include "../LevelingSchedule.h"
+#include "../PsdCalibration.h"
+
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Settings of the firmware the logs were recorded with, used to rebuild the
+// moves it made. Also the regime of the fixed runs (GAIN_SCHEDULING off).
+const LevelingRegime recordedRegime = {"FIXED", 1.5E-2, 1.0, 10, 10000, 10000};
+// Firmware loop period, one raw reading per pass
+const uint32_t loopMs = 75;
+// Lowest SUM voltage with the laser on the sensor
+const double minSum = 2.5;
+// Fitted step gains are limited to this range
+const double minStepGain = 0.5;
+const double maxStepGain = 1.5;
+// Distance counted as on target, as in SerialData.py
+const double targetMm = 0.04;
+// Metrics may differ from the baseline by this much (rounding in the file)
+const double baselineSlack = 1E-6;
+
+
+/*------------------------------------------------------------------------------
+ * ReplayPlant
+ *
+ *    Drift of the sample and step response of the stage rebuilt from one
+ *    leveling run in a log.
+ -----------------------------------------------------------------------------*/
+struct ReplayPlant {
+    std::vector<uint32_t> timeMs;
+    std::vector<double> driftX, driftY, sum;
+    std::vector<double> inputX, inputY; // readings as logged
+    double levelX, levelY;
+    double gainX, gainY; // volts moved per deltaX/deltaY volts commanded
+};
+
+struct ReplayMetrics {
+    double meanMm, stdMm, maxMm;
+    double withinPercent;
+    double moves, steps;
+    double coarseMoves; // moves made in the coarse regime, not in the baseline
+};
+
+struct ReplayResult {
+    std::string key;
+    bool replayed;
+    ReplayMetrics recorded;
+    ReplayMetrics replay;
+};
+
+const int metricCount = 6;
+const char *const metricNames[metricCount] = {"mean_mm", "std_mm", "max_mm", "within_pct", "moves", "steps"};
+// +1 if a larger value is worse, -1 if a smaller value is worse
+const int metricWorse[metricCount] = {1, 1, 1, -1, 1, 1};
+
+static double Metric(const ReplayMetrics &metrics, int i) {
+    const double values[metricCount] = {metrics.meanMm, metrics.stdMm, metrics.maxMm,
+                                        metrics.withinPercent, metrics.moves, metrics.steps};
+    return values[i];
+}
+
+
+// Spot position in mm with the linear formula used by SerialData.py
+static double PositionMm(double voltage, double sum) {
+    return 10 * (voltage - 5) / (2 * sum);
+}
+
+// Least squares gain of "moved" over "commanded", 1 if nothing was moved
+static double FitGain(const std::vector<double> &commanded, const std::vector<double> &moved) {
+    double cross = 0, square = 0;
+    for (size_t i = 0; i < commanded.size(); i++) {
+        cross += commanded[i] * moved[i];
+        square += commanded[i] * commanded[i];
+    }
+    if (square == 0) {
+        return 1.0;
+    }
+    double gain = cross / square;
+    return gain < minStepGain ? minStepGain : gain > maxStepGain ? maxStepGain : gain;
+}
+
+
+/*------------------------------------------------------------------------------
+ * BuildPlant
+ *
+ *    Uses the first leveling run in the log (readings with the same non-zero
+ *    level position). The moves the recording firmware made after each
+ *    reading are recomputed from recordedRegime. The step gain of each axis
+ *    is fitted from the change in the next reading, and the sum of the
+ *    fitted moves is subtracted from the readings to leave the drift.
+ *
+ * Parameters:
+ *    const Trace &trace        - Log to replay
+ *    ReplayPlant &plant        - Filled in
+ *    ReplayMetrics &recorded   - Metrics of the run as it was recorded
+ *
+ * Returns: False if the log has no leveling run
+ -----------------------------------------------------------------------------*/
+static bool BuildPlant(const Trace &trace, ReplayPlant &plant, ReplayMetrics &recorded) {
+    const std::vector<TraceSample> &samples = trace.samples;
+    size_t first = 0;
+    while (first < samples.size() && samples[first].levelX == 0 && samples[first].levelY == 0) {
+        first++;
+    }
+    size_t last = first;
+    while (last < samples.size() && samples[last].levelX == samples[first].levelX &&
+           samples[last].levelY == samples[first].levelY) {
+        last++;
+    }
+    if (last - first < 2) {
+        return false;
+    }
+
+    PsdCalibration noMap;
+    plant.levelX = samples[first].levelX;
+    plant.levelY = samples[first].levelY;
+
+    // Moves of the recording firmware, in volts of expected spot motion
+    std::vector<double> commandX, commandY, movedX, movedY;
+    std::vector<double> correctionX(1, 0.0), correctionY(1, 0.0);
+    recorded.moves = 0;
+    recorded.steps = 0;
+    recorded.coarseMoves = 0;
+    for (size_t k = first; k < last; k++) {
+        const TraceSample &sample = samples[k];
+        LevelingMove move = RegimeMove(recordedRegime, noMap, plant.levelX, plant.levelY,
+                                       sample.inputX, sample.inputY, sample.inputSum);
+        double changeX = 0, changeY = 0;
+        if (sample.inputSum >= minSum && move.moveX) {
+            changeX = move.stepsX * deltaX;
+            recorded.moves++;
+            recorded.steps += labs(move.stepsX);
+        }
+        if (sample.inputSum >= minSum && move.moveY) {
+            changeY = -move.stepsY * deltaY;
+            recorded.moves++;
+            recorded.steps += labs(move.stepsY);
+        }
+        if (k + 1 < last) {
+            if (changeX != 0) {
+                commandX.push_back(changeX);
+                movedX.push_back(samples[k + 1].inputX - sample.inputX);
+            }
+            if (changeY != 0) {
+                commandY.push_back(changeY);
+                movedY.push_back(samples[k + 1].inputY - sample.inputY);
+            }
+        }
+        correctionX.push_back(correctionX.back() + changeX);
+        correctionY.push_back(correctionY.back() + changeY);
+    }
+    plant.gainX = FitGain(commandX, movedX);
+    plant.gainY = FitGain(commandY, movedY);
+
+    for (size_t k = first; k < last; k++) {
+        plant.timeMs.push_back(samples[k].timeMs);
+        plant.driftX.push_back(samples[k].inputX - plant.gainX * correctionX[k - first]);
+        plant.driftY.push_back(samples[k].inputY - plant.gainY * correctionY[k - first]);
+        plant.sum.push_back(samples[k].inputSum);
+        plant.inputX.push_back(samples[k].inputX);
+        plant.inputY.push_back(samples[k].inputY);
+    }
+    return true;
+}
+
+// Linear interpolation of a plant signal at "timeMs", index is the segment
+// found on the previous call and is moved forward as time goes on
+static double Interpolate(const std::vector<uint32_t> &timeMs, const std::vector<double> &values,
+                          size_t &index, uint32_t nowMs) {
+    while (index + 2 < timeMs.size() && timeMs[index + 1] <= nowMs) {
+        index++;
+    }
+    uint32_t span = timeMs[index + 1] - timeMs[index];
+    double fraction = span ? double(nowMs - timeMs[index]) / span : 0;
+    if (fraction > 1) {
+        fraction = 1;
+    }
+    return values[index] + fraction * (values[index + 1] - values[index]);
+}
+
+
+/*------------------------------------------------------------------------------
+ * ScorePositions
+ *
+ *    Distance from the level position over the run, as in SerialData.py.
+ *    Std is the sample standard deviation (pandas default).
+ -----------------------------------------------------------------------------*/
+static void ScorePositions(const ReplayPlant &plant, const std::vector<double> &x,
+                           const std::vector<double> &y, ReplayMetrics &metrics) {
+    size_t n = x.size();
+    double centerX = 0, centerY = 0;
+    for (size_t k = 0; k < n; k++) {
+        centerX += PositionMm(plant.levelX, plant.sum[k]);
+        centerY += PositionMm(plant.levelY, plant.sum[k]);
+    }
+    centerX /= n;
+    centerY /= n;
+
+    double total = 0, square = 0, within = 0;
+    metrics.maxMm = 0;
+    for (size_t k = 0; k < n; k++) {
+        double distance = hypot(PositionMm(x[k], plant.sum[k]) - centerX,
+                                PositionMm(y[k], plant.sum[k]) - centerY);
+        total += distance;
+        square += distance * distance;
+        if (distance > metrics.maxMm) {
+            metrics.maxMm = distance;
+        }
+        if (distance <= targetMm) {
+            within++;
+        }
+    }
+    metrics.meanMm = total / n;
+    metrics.stdMm = n > 1 ? sqrt((square - n * metrics.meanMm * metrics.meanMm) / (n - 1)) : 0;
+    metrics.withinPercent = 100.0 * within / n;
+}
+
+
+/*------------------------------------------------------------------------------
+ * ReplayRun
+ *
+ *    Runs the leveling loop of main() against the plant: one raw reading
+ *    every loopMs, averaged over the regime's numSamples, then the regime
+ *    update and RegimeMove as in the firmware. Moves take effect on the
+ *    next raw reading. The position is scored at the logged reading times.
+ *
+ * Parameters:
+ *    const ReplayPlant &plant  - Plant built from the log
+ *    bool scheduling           - Use LevelingSchedule, else recordedRegime
+ *    ReplayMetrics &metrics    - Filled in
+ *
+ * Returns: Nothing
+ -----------------------------------------------------------------------------*/
+static void ReplayRun(const ReplayPlant &plant, bool scheduling, ReplayMetrics &metrics) {
+    PsdCalibration noMap;
+    LevelingSchedule schedule;
+    LevelingRegime regime = recordedRegime;
+    if (scheduling) {
+        schedule.Reset(plant.timeMs.front());
+        regime = schedule.Regime();
+    }
+
+    VoltageAverage average;
+    int count = 1; // as in main() after a Take, so each window is numSamples readings
+    double correctionX = 0, correctionY = 0; // stage motion in volts
+    size_t segment = 0, scored = 0;
+    std::vector<double> positionX, positionY;
+    metrics.moves = 0;
+    metrics.steps = 0;
+    metrics.coarseMoves = 0;
+
+    for (uint32_t nowMs = plant.timeMs.front(); scored < plant.timeMs.size(); nowMs += loopMs) {
+        double voltageX = Interpolate(plant.timeMs, plant.driftX, segment, nowMs) + correctionX;
+        double voltageY = Interpolate(plant.timeMs, plant.driftY, segment, nowMs) + correctionY;
+        double voltageSum = Interpolate(plant.timeMs, plant.sum, segment, nowMs);
+
+        while (scored < plant.timeMs.size() && plant.timeMs[scored] <= nowMs) {
+            positionX.push_back(plant.driftX[scored] + correctionX);
+            positionY.push_back(plant.driftY[scored] + correctionY);
+            scored++;
+        }
+
+        average.Add(voltageX, voltageY, voltageSum);
+        if (count >= regime.numSamples) {
+            double inputX, inputY, inputSum;
+            average.Take(count, inputX, inputY, inputSum);
+            count = 0;
+
+            if (inputSum >= minSum) {
+                if (scheduling && schedule.Update(nowMs, inputX - plant.levelX, inputY - plant.levelY)) {
+                    regime = schedule.Regime();
+                }
+                LevelingMove move = RegimeMove(regime, noMap, plant.levelX, plant.levelY,
+                                               inputX, inputY, inputSum);
+                if (scheduling && schedule.Coarse()) {
+                    metrics.coarseMoves += move.moveX + move.moveY;
+                }
+                if (move.moveX) {
+                    correctionX += plant.gainX * move.stepsX * deltaX;
+                    schedule.Corrected((plant.levelX - inputX) * regime.gain, 0);
+                    metrics.moves++;
+                    metrics.steps += labs(move.stepsX);
+                }
+                if (move.moveY) {
+                    correctionY -= plant.gainY * move.stepsY * deltaY;
+                    schedule.Corrected(0, (plant.levelY - inputY) * regime.gain);
+                    metrics.moves++;
+                    metrics.steps += labs(move.stepsY);
+                }
+            }
+        }
+        count += 1;
+    }
+    ScorePositions(plant, positionX, positionY, metrics);
+}
+
+static void ReplayTrace(const Trace &trace, bool scheduling, ReplayResult &result) {
+    ReplayPlant plant;
+    result.replayed = BuildPlant(trace, plant, result.recorded);
+    if (!result.replayed) {
+        return;
+    }
+    ScorePositions(plant, plant.inputX, plant.inputY, result.recorded);
+    ReplayRun(plant, scheduling, result.replay);
+}
+
+
+// Baseline file: one line per log, "key metric metric ..."
+static std::map<std::string, ReplayMetrics> ReadBaseline(const std::string &path) {
+    std::map<std::string, ReplayMetrics> baseline;
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file) {
+        return baseline;
+    }
+    char line[512], key[256];
+    ReplayMetrics metrics;
+    metrics.coarseMoves = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] != '#' &&
+            sscanf(line, "%255s %lf %lf %lf %lf %lf %lf", key, &metrics.meanMm, &metrics.stdMm,
+                   &metrics.maxMm, &metrics.withinPercent, &metrics.moves, &metrics.steps) == 7) {
+            baseline[key] = metrics;
+        }
+    }
+    fclose(file);
+    return baseline;
+}
+
+static bool WriteBaseline(const std::string &path, const std::map<std::string, ReplayMetrics> &baseline) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "# LevelingReplay baseline: log:mode");
+    for (int i = 0; i < metricCount; i++) {
+        fprintf(file, " %s", metricNames[i]);
+    }
+    fprintf(file, "\n# Regenerate with: make -C HostTools replay-baseline\n");
+    std::map<std::string, ReplayMetrics>::const_iterator it;
+    for (it = baseline.begin(); it != baseline.end(); ++it) {
+        const ReplayMetrics &m = it->second;
+        fprintf(file, "%s %.6f %.6f %.6f %.6f %.0f %.0f\n", it->first.c_str(),
+                m.meanMm, m.stdMm, m.maxMm, m.withinPercent, m.moves, m.steps);
+    }
+    fclose(file);
+    return true;
+}
+
+static void PrintMetrics(const char *label, const ReplayMetrics &m) {
+    printf("  %-9s %9.4f %9.4f %9.4f %9.2f %7.0f %9.0f\n", label,
+           m.meanMm, m.stdMm, m.maxMm, m.withinPercent, m.moves, m.steps);
+}
+
+
+int main(int argc, char **argv) {
+    std::string baselinePath = "replay_baseline.txt";
+    bool update = false;
+    bool runScheduled = true;
+    bool runFixed = true;
+    std::vector<Trace> traces;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+            baselinePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--update")) {
+            update = true;
+        }
+        else if (!strcmp(argv[i], "--scheduled")) {
+            runFixed = false;
+        }
+        else if (!strcmp(argv[i], "--fixed")) {
+            runScheduled = false;
+        }
+        else {
+            Trace trace;
+            if (!ReadTrace(argv[i], trace)) {
+                fprintf(stderr, "Could not read %s\n", argv[i]);
+                return 2;
+            }
+            traces.push_back(trace);
+        }
+    }
+    if (traces.empty() || (!runScheduled && !runFixed)) {
+        fprintf(stderr, "Usage: %s [--baseline FILE] [--update] [--scheduled | --fixed] LOG.csv...\n",
+                argv[0]);
+        return 2;
+    }
+
+    std::vector<bool> modes;
+    if (runScheduled) {
+        modes.push_back(true);
+    }
+    if (runFixed) {
+        modes.push_back(false);
+    }
+    std::vector<ReplayResult> results(traces.size() * modes.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < traces.size(); i++) {
+        for (size_t m = 0; m < modes.size(); m++) {
+            ReplayResult &result = results[i * modes.size() + m];
+            result.key = traces[i].name + (modes[m] ? ":scheduled" : ":fixed");
+            threads.push_back(std::thread(ReplayTrace, std::cref(traces[i]), modes[m], std::ref(result)));
+        }
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    std::map<std::string, ReplayMetrics> baseline = ReadBaseline(baselinePath);
+    bool failed = false;
+    printf("%-11s %9s %9s %9s %9s %7s %9s\n", "", "mean mm", "std mm", "max mm", "% in", "moves", "steps");
+    for (size_t i = 0; i < results.size(); i++) {
+        const ReplayResult &result = results[i];
+        printf("%s\n", result.key.c_str());
+        if (!result.replayed) {
+            printf("  no leveling run, skipped\n");
+            continue;
+        }
+        PrintMetrics("recorded", result.recorded);
+        PrintMetrics("replay", result.replay);
+
+        std::map<std::string, ReplayMetrics>::const_iterator base = baseline.find(result.key);
+        if (update) {
+            continue;
+        }
+        if (base == baseline.end()) {
+            printf("  FAIL not in %s\n", baselinePath.c_str());
+            failed = true;
+            continue;
+        }
+        PrintMetrics("baseline", base->second);
+        for (int m = 0; m < metricCount; m++) {
+            double change = Metric(result.replay, m) - Metric(base->second, m);
+            double slack = baselineSlack * (1 + fabs(Metric(base->second, m)));
+            if (change * metricWorse[m] > slack) {
+                printf("  FAIL %s worse: %.6f -> %.6f\n", metricNames[m],
+                       Metric(base->second, m), Metric(result.replay, m));
+                failed = true;
+            }
+        }
+    }
+
+    if (modes.size() == 2) {
+        printf("\nScheduled vs fixed: %% in, mean mm, moves (scheduled moves made in coarse)\n");
+        for (size_t i = 0; i < traces.size(); i++) {
+            const ReplayResult &scheduled = results[2 * i];
+            const ReplayResult &fixed = results[2 * i + 1];
+            if (scheduled.replayed) {
+                printf("  %-28s %6.2f vs %6.2f  %7.4f vs %7.4f  %5.0f vs %5.0f (%.0f)\n",
+                       traces[i].name.c_str(), scheduled.replay.withinPercent, fixed.replay.withinPercent,
+                       scheduled.replay.meanMm, fixed.replay.meanMm,
+                       scheduled.replay.moves, fixed.replay.moves, scheduled.replay.coarseMoves);
+            }
+        }
+    }
+
+    if (update) {
+        for (size_t i = 0; i < results.size(); i++) {
+            if (results[i].replayed) {
+                baseline[results[i].key] = results[i].replay;
+            }
+        }
+        if (!WriteBaseline(baselinePath, baseline)) {
+            fprintf(stderr, "Could not write %s\n", baselinePath.c_str());
+            return 2;
+        }
+        printf("\nBaseline written to %s\n", baselinePath.c_str());
+        return 0;
+    }
+    printf("\n%s\n", failed ? "FAIL" : "PASS");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+/*==========================================================
+; File Name: TraceReader.cpp
+;
+; Description:
+; CSV reader for the serial leveling logs. The columns are
+; PC_Timestamp,Device_Time_ms,LevelX,LevelY,inputVoltageX,
+; inputVoltageY,inputVoltageSUM (some logs have spaces after commas).
+;
+;========================================================== */
+
+#include "TraceReader.h"
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+bool ReadTrace(const std::string &path, Trace &trace) {
+    std::ifstream file(path.c_str());
+    if (!file) {
+        return false;
+    }
+
+    size_t slash = path.find_last_of("/\\");
+    trace.name = slash == std::string::npos ? path : path.substr(slash + 1);
+    trace.samples.clear();
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, ',')) {
+            fields.push_back(field);
+        }
+        if (fields.size() != 7) {
+            continue;
+        }
+
+        double values[6];
+        bool parsed = true;
+        for (int i = 0; i < 6 && parsed; i++) {
+            const char *text = fields[i + 1].c_str();
+            char *end;
+            values[i] = strtod(text, &end);
+            parsed = end != text;
+        }
+        if (!parsed) {
+            continue; // header line
+        }
+
+        TraceSample sample;
+        sample.timeMs = (uint32_t)values[0];
+        sample.levelX = values[1];
+        sample.levelY = values[2];
+        sample.inputX = values[3];
+        sample.inputY = values[4];
+        sample.inputSum = values[5];
+        trace.samples.push_back(sample);
+    }
+    return !trace.samples.empty();
+}
@@ -0,0 +1,33 @@
+/*==========================================================
+; File Name: TraceReader.h
+;
+; Description:
+; Reads the serial leveling logs in SerialSensorData/ (as written by
+; EllipData.py) for the host tools.
+;
+;========================================================== */
+
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// One averaged reading from a serial log
+struct TraceSample {
+    uint32_t timeMs;
+    double levelX, levelY;
+    double inputX, inputY, inputSum;
+};
+
+struct Trace {
+    std::string name;
+    std::vector<TraceSample> samples;
+};
+
+// Reads a log, lines that do not parse are skipped. Returns false if the
+// file could not be opened or held no samples.
+bool ReadTrace(const std::string &path, Trace &trace);
+
+#endif // TRACE_READER_H
@@ -0,0 +1,60 @@
+/*==========================================================
+; File Name: LevelingMath.h
+;
+; Description:
+; Per-sample math used by the leveling loop in main(): ADC to voltage
+; conversion, the boxcar average, tolerance checks and the linear step
+; computation. Kept in one header so the same code runs on the
+; ClearCore and in the host benchmarks.
+;
+;========================================================== */
+
+#ifndef LEVELING_MATH_H
+#define LEVELING_MATH_H
+
+#include <stdint.h>
+
+// Converts an ADC reading to a 0-10V voltage
+inline double AdcToVoltage(int16_t adc, int resolution) {
+    return 10.0 * adc / ((1 << resolution) - 1);
+}
+
+// True if the position is more than "tolerance" away from the level position
+inline bool OutOfTolerance(double position, double level, double tolerance) {
+    return (position > (level + tolerance)) || (position < (level - tolerance));
+}
+
+// Steps that move the spot by "error" volts with a linear volts per step gain
+inline int32_t LinearSteps(double error, double voltsPerStep) {
+    return int32_t(error / voltsPerStep);
+}
+
+
+/*------------------------------------------------------------------------------
+ * VoltageAverage
+ *
+ *    Running sums of the X, Y and SUM voltages for the boxcar average.
+ -----------------------------------------------------------------------------*/
+struct VoltageAverage {
+    double sumX, sumY, sumSum;
+
+    VoltageAverage() : sumX(0), sumY(0), sumSum(0) {}
+
+    void Add(double voltageX, double voltageY, double voltageSum) {
+        sumX += voltageX;
+        sumY += voltageY;
+        sumSum += voltageSum;
+    }
+
+    // Computes the averages over "samples" readings and starts a new sum
+    void Take(int samples, double &averageX, double &averageY, double &averageSum) {
+        averageX = sumX / samples;
+        averageY = sumY / samples;
+        averageSum = sumSum / samples;
+        sumX = 0;
+        sumY = 0;
+        sumSum = 0;
+    }
+};
+
+#endif // LEVELING_MATH_H
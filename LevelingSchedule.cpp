@@ -0,0 +1,130 @@
+/*==========================================================
+; File Name: LevelingSchedule.cpp
+;
+; Description:
+; Drift estimation and coarse/fine regime switching.
+;
+;========================================================== */
+
+#include "LevelingSchedule.h"
+#include "LevelingMath.h"
+#include <math.h>
+
+LevelingSchedule::LevelingSchedule() {
+    Reset(0);
+}
+
+void LevelingSchedule::Reset(uint32_t nowMs) {
+    coarse = true;
+    correctionX = 0;
+    correctionY = 0;
+    historyCount = 0;
+    historyNext = 0;
+    driftRate = 0;
+    quietSinceMs = nowMs;
+    quiet = false;
+}
+
+void LevelingSchedule::Corrected(double changeX, double changeY) {
+    correctionX += changeX;
+    correctionY += changeY;
+}
+
+/*------------------------------------------------------------------------------
+ * LevelingSchedule::Update
+ *
+ *    Removes the commanded corrections from the error to get the position
+ *    the spot would have drifted to without leveling, and takes the drift
+ *    rate as the least squares slope of that over the last driftHistory
+ *    readings.
+ *    Switches to coarse as soon as the drift rate or error is too large, and
+ *    back to fine once both have stayed small for fineDwellMs.
+ *
+ * Parameters:
+ *    uint32_t nowMs          - Time of the reading
+ *    double errorX, errorY   - Averaged position minus level position, in volts
+ *
+ * Returns: True if the regime changed
+ -----------------------------------------------------------------------------*/
+bool LevelingSchedule::Update(uint32_t nowMs, double errorX, double errorY) {
+    historyMs[historyNext] = nowMs;
+    historyX[historyNext] = errorX - correctionX;
+    historyY[historyNext] = errorY - correctionY;
+    historyNext = (historyNext + 1) % driftHistory;
+    if (historyCount < driftHistory) {
+        historyCount++;
+    }
+
+    if (historyCount >= driftHistory / 2) {
+        // Times relative to the newest reading keep the sums small
+        double sumT = 0, sumX = 0, sumY = 0, sumTT = 0, sumTX = 0, sumTY = 0;
+        for (int k = 0; k < historyCount; k++) {
+            double t = -(double)(nowMs - historyMs[k]) / 1000.0;
+            sumT += t;
+            sumX += historyX[k];
+            sumY += historyY[k];
+            sumTT += t * t;
+            sumTX += t * historyX[k];
+            sumTY += t * historyY[k];
+        }
+        double spread = historyCount * sumTT - sumT * sumT;
+        if (spread > 0) {
+            double rateX = fabs(historyCount * sumTX - sumT * sumX) / spread;
+            double rateY = fabs(historyCount * sumTY - sumT * sumY) / spread;
+            driftRate = rateX > rateY ? rateX : rateY;
+        }
+    }
+
+    double error = fabs(errorX) > fabs(errorY) ? fabs(errorX) : fabs(errorY);
+    bool wasCoarse = coarse;
+    if (driftRate > coarseDriftRate || error > coarseError) {
+        coarse = true;
+        quiet = false;
+    }
+    else if (coarse) {
+        if (driftRate < fineDriftRate && error < fineError) {
+            if (!quiet) {
+                quiet = true;
+                quietSinceMs = nowMs;
+            }
+            if (nowMs - quietSinceMs >= fineDwellMs) {
+                coarse = false;
+            }
+        }
+        else {
+            quiet = false;
+        }
+    }
+    return coarse != wasCoarse;
+}
+
+/*------------------------------------------------------------------------------
+ * RegimeMove
+ *
+ *    Computes the steps that bring the spot back to the level position,
+ *    from the calibration map when one is stored and otherwise from the
+ *    linear deltaX/deltaY gains, scaled by the gain of the regime.
+ *
+ * Parameters:
+ *    const LevelingRegime &regime           - Regime in use
+ *    const PsdCalibration &calibration      - Stored PSD calibration map
+ *    double levelX, levelY                  - Level position in volts
+ *    double inputX, inputY, inputSum        - Averaged reading in volts
+ *
+ * Returns: Axes to move and their step counts
+ -----------------------------------------------------------------------------*/
+LevelingMove RegimeMove(const LevelingRegime &regime, const PsdCalibration &calibration,
+                        double levelX, double levelY, double inputX, double inputY,
+                        double inputSum) {
+    LevelingMove move;
+    move.stepsX = LinearSteps(levelX - inputX, deltaX);
+    move.stepsY = LinearSteps(inputY - levelY, deltaY);
+    if (calibration.Valid()) {
+        calibration.Correction(inputX, inputY, levelX, levelY, inputSum, move.stepsX, move.stepsY);
+    }
+    move.stepsX = int32_t(move.stepsX * regime.gain);
+    move.stepsY = int32_t(move.stepsY * regime.gain);
+    move.moveX = OutOfTolerance(inputX, levelX, regime.tolerance);
+    move.moveY = OutOfTolerance(inputY, levelY, regime.tolerance);
+    return move;
+}
@@ -0,0 +1,110 @@
+/*==========================================================
+; File Name: LevelingSchedule.h
+;
+; Description:
+; Gain scheduling between a coarse and a fine leveling regime. Coarse is
+; for fast catch-up while the sample heats: short averaging, fast moves
+; and a gain above one, so each move goes past level and the drift
+; carries the spot back through it. Fine is for the isothermal hold: a
+; tighter tolerance than the fixed loop, long averaging so noise does
+; not make the motors chase, gentle moves and plain corrections. The
+; regime is picked from the drift rate of the sample (the error with the
+; commanded corrections taken back out) and the size of the error, with
+; separate enter and exit levels and a dwell time so it does not flip
+; back and forth.
+;
+; This file does not depend on ClearCore so it can also be built on a PC.
+;
+;========================================================== */
+
+#ifndef LEVELING_SCHEDULE_H
+#define LEVELING_SCHEDULE_H
+
+#include <stdint.h>
+#include "PsdCalibration.h"
+
+/*------------------------------------------------------------------------------
+ * LevelingRegime
+ *
+ *    Settings used by the leveling loop while a regime is active.
+ -----------------------------------------------------------------------------*/
+struct LevelingRegime {
+    const char *name;
+    double tolerance;          // X and Y tolerance in volts
+    double gain;               // multiple of the computed correction to move
+    int numSamples;            // readings in the average
+    int32_t velocityLimit;     // pulses per sec
+    int32_t accelerationLimit; // pulses per sec^2
+};
+
+const LevelingRegime coarseRegime = {"COARSE", 1.5E-2, 1.5, 4, 20000, 40000};
+const LevelingRegime fineRegime = {"FINE", 1.25E-2, 1.0, 20, 4000, 5000};
+
+// Drift rate (V/s) or error (V) above which the coarse regime is used
+const double coarseDriftRate = 6.0E-3;
+const double coarseError = 4.5E-2;
+// Drift rate and error that must hold for fineDwellMs to return to fine
+const double fineDriftRate = 2.4E-3;
+const double fineError = 1.25E-2;
+const uint32_t fineDwellMs = 5000;
+// Readings used to estimate the drift rate
+const int driftHistory = 24;
+// Volts the spot moves for one step with the linear gain
+const double deltaX = 2E-4;
+const double deltaY = 2E-4;
+
+
+/*------------------------------------------------------------------------------
+ * LevelingMove
+ *
+ *    Correction for one averaged reading. An axis within the tolerance of
+ *    the regime is not moved.
+ -----------------------------------------------------------------------------*/
+struct LevelingMove {
+    bool moveX, moveY;
+    int32_t stepsX, stepsY;
+};
+
+LevelingMove RegimeMove(const LevelingRegime &regime, const PsdCalibration &calibration,
+                        double levelX, double levelY, double inputX, double inputY,
+                        double inputSum);
+
+
+/*------------------------------------------------------------------------------
+ * LevelingSchedule
+ *
+ *    Call Update() with every averaged error and Corrected() with the part
+ *    of the error every move that is made was meant to remove (the error
+ *    times the gain of the regime). That is taken from the error and not
+ *    from the steps, so it does not depend on how the steps were computed.
+ -----------------------------------------------------------------------------*/
+class LevelingSchedule {
+public:
+    LevelingSchedule();
+
+    // Leveling (re)started, begins in the coarse regime
+    void Reset(uint32_t nowMs);
+    // Updates the drift estimate and regime, returns true if the regime changed
+    bool Update(uint32_t nowMs, double errorX, double errorY);
+    // A move is expected to change the X and Y errors by these voltages
+    void Corrected(double changeX, double changeY);
+
+    const LevelingRegime &Regime() const { return coarse ? coarseRegime : fineRegime; }
+    bool Coarse() const { return coarse; }
+    // Largest of the X and Y drift rates in V/s
+    double DriftRate() const { return driftRate; }
+
+private:
+    bool coarse;
+    double correctionX, correctionY; // sum of expected changes from moves
+    uint32_t historyMs[driftHistory];
+    double historyX[driftHistory];
+    double historyY[driftHistory];
+    int historyCount;
+    int historyNext;
+    double driftRate;
+    uint32_t quietSinceMs;
+    bool quiet;
+};
+
+#endif // LEVELING_SCHEDULE_H
@@ -0,0 +1,70 @@
+/*==========================================================
+; File Name: MotorHold.cpp
+;
+; Description:
+; Hold mode timing and statistics for one axis.
+;
+;========================================================== */
+
+#include "MotorHold.h"
+
+AxisHold::AxisHold()
+    : active(false), energized(false), startMs(0), lastActivityMs(0),
+      energizedSinceMs(0), energizedTotalMs(0), wakes(0), correctionWakes(0),
+      latencyTotalUs(0), latencyMaxUs(0), timeouts(0) {}
+
+void AxisHold::Start(uint32_t nowMs) {
+    *this = AxisHold();
+    active = true;
+    energized = true;
+    startMs = nowMs;
+    lastActivityMs = nowMs;
+    energizedSinceMs = nowMs;
+}
+
+void AxisHold::Stop(uint32_t nowMs) {
+    Released(nowMs);
+    active = false;
+}
+
+bool AxisHold::SettleElapsed(uint32_t nowMs) const {
+    return active && energized && nowMs - lastActivityMs >= holdSettleMs;
+}
+
+void AxisHold::Released(uint32_t nowMs) {
+    if (energized) {
+        energizedTotalMs += nowMs - energizedSinceMs;
+        energized = false;
+    }
+}
+
+void AxisHold::Woken(uint32_t nowMs, uint32_t latencyUs, bool delayedCorrection) {
+    energized = true;
+    energizedSinceMs = nowMs;
+    lastActivityMs = nowMs;
+    wakes++;
+    if (delayedCorrection) {
+        correctionWakes++;
+        latencyTotalUs += latencyUs;
+        if (latencyUs > latencyMaxUs) {
+            latencyMaxUs = latencyUs;
+        }
+    }
+}
+
+void AxisHold::Activity(uint32_t nowMs) {
+    lastActivityMs = nowMs;
+}
+
+uint32_t AxisHold::DutyPermille(uint32_t nowMs) const {
+    uint32_t elapsed = nowMs - startMs;
+    if (elapsed == 0) {
+        return 1000;
+    }
+    uint32_t energizedMs = energizedTotalMs + (energized ? nowMs - energizedSinceMs : 0);
+    return (uint32_t)((uint64_t)energizedMs * 1000 / elapsed);
+}
+
+uint32_t AxisHold::MeanLatencyUs() const {
+    return correctionWakes ? latencyTotalUs / correctionWakes : 0;
+}
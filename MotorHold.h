@@ -0,0 +1,79 @@
+/*==========================================================
+; File Name: MotorHold.h
+;
+; Description:
+; Bookkeeping for the motor hold mode. In this mode an axis is
+; de-energized once it has been idle for holdSettleMs and is enabled
+; again when a correction is needed. AxisHold decides when an axis may
+; be released and keeps the duty cycle and re-enable latency reported in
+; telemetry. The motor itself is driven from SeniorProject.cpp.
+;
+; This file does not depend on ClearCore so it can also be built on a PC.
+;
+;========================================================== */
+
+#ifndef MOTOR_HOLD_H
+#define MOTOR_HOLD_H
+
+#include <stdint.h>
+
+// Idle time after a move or wake before an axis is de-energized
+const uint32_t holdSettleMs = 3000;
+// Longest wait for HLFB to assert after re-enabling an axis
+const uint32_t hlfbEnableTimeoutMs = 250;
+// An axis is woken early when its error passes this fraction of the
+// tolerance, so it is usually ready before a correction is needed
+const double holdWakeFraction = 0.6;
+
+
+/*------------------------------------------------------------------------------
+ * AxisHold
+ *
+ *    Hold state and statistics for one axis during a leveling run.
+ -----------------------------------------------------------------------------*/
+class AxisHold {
+public:
+    AxisHold();
+
+    // Leveling started with the axis energized
+    void Start(uint32_t nowMs);
+    // Leveling stopped, the axis is de-energized by the caller
+    void Stop(uint32_t nowMs);
+    bool Active() const { return active; }
+    bool Energized() const { return energized; }
+
+    // True once an energized axis has been idle for holdSettleMs
+    bool SettleElapsed(uint32_t nowMs) const;
+    void Released(uint32_t nowMs);
+    // The axis was re-enabled and took latencyUs to assert HLFB. If
+    // "delayedCorrection" is set a move was waiting on it.
+    void Woken(uint32_t nowMs, uint32_t latencyUs, bool delayedCorrection);
+    // HLFB did not assert within hlfbEnableTimeoutMs, the axis stays released
+    void WakeTimedOut() { timeouts++; }
+    // A move was made, restarts the settle time
+    void Activity(uint32_t nowMs);
+
+    // Energized time over the run in tenths of a percent
+    uint32_t DutyPermille(uint32_t nowMs) const;
+    uint32_t Wakes() const { return wakes; }
+    uint32_t CorrectionWakes() const { return correctionWakes; }
+    // Re-enable latency added to corrections
+    uint32_t MeanLatencyUs() const;
+    uint32_t MaxLatencyUs() const { return latencyMaxUs; }
+    uint32_t Timeouts() const { return timeouts; }
+
+private:
+    bool active;
+    bool energized;
+    uint32_t startMs;
+    uint32_t lastActivityMs;
+    uint32_t energizedSinceMs;
+    uint32_t energizedTotalMs;
+    uint32_t wakes;
+    uint32_t correctionWakes;
+    uint32_t latencyTotalUs;
+    uint32_t latencyMaxUs;
+    uint32_t timeouts;
+};
+
+#endif // MOTOR_HOLD_H
@@ -0,0 +1,273 @@
+/*==========================================================
+; File Name: PsdCalibration.cpp
+;
+; Description:
+; Builds the (u, v) to steps map from a calibration raster and applies
+; it in the leveling loop. The raster is regular in steps, so it is
+; inverted once with Newton iterations on its bilinear interpolation.
+; The map is regular in (u, v) so a lookup is a single bilinear
+; interpolation in single precision. It is packed for storage, and the
+; map used for lookups is always the one unpacked from the stored form so
+; it is the same before and after a power cycle.
+;
+;========================================================== */
+
+#include "PsdCalibration.h"
+#include <math.h>
+#include <string.h>
+
+static const int calCenter = calGridSize / 2;
+static const int mapCenter = calMapSize / 2;
+
+
+/*------------------------------------------------------------------------------
+ * Cell
+ *
+ *    Finds the grid cell and the position inside it for a grid coordinate.
+ *    Coordinates outside the grid use the edge cell so values are linearly
+ *    extrapolated.
+ -----------------------------------------------------------------------------*/
+static inline int Cell(float coordinate, int gridSize, float &fraction) {
+    int index = (int)floorf(coordinate);
+    if (index < 0) {
+        index = 0;
+    }
+    else if (index > gridSize - 2) {
+        index = gridSize - 2;
+    }
+    fraction = coordinate - index;
+    return index;
+}
+
+/*------------------------------------------------------------------------------
+ * RasterForward
+ *
+ *    Interpolates the measured (u, v) at a stage position and returns the
+ *    partial derivatives per step, used by the Newton inversion.
+ -----------------------------------------------------------------------------*/
+static void RasterForward(const CalibrationRaster &raster, double sx, double sy,
+                          double &u, double &v, double jacobian[2][2]) {
+    float tx, ty;
+    int i = Cell((float)(sx / calStepSpacing + calCenter), calGridSize, tx);
+    int j = Cell((float)(sy / calStepSpacing + calCenter), calGridSize, ty);
+    const float (*grids[2])[calGridSize] = {raster.u, raster.v};
+    double result[2];
+
+    for (int g = 0; g < 2; g++) {
+        double p00 = grids[g][j][i], p10 = grids[g][j][i + 1];
+        double p01 = grids[g][j + 1][i], p11 = grids[g][j + 1][i + 1];
+        result[g] = (1 - ty) * ((1 - tx) * p00 + tx * p10) + ty * ((1 - tx) * p01 + tx * p11);
+        jacobian[g][0] = ((1 - ty) * (p10 - p00) + ty * (p11 - p01)) / calStepSpacing;
+        jacobian[g][1] = ((1 - tx) * (p01 - p00) + tx * (p11 - p10)) / calStepSpacing;
+    }
+    u = result[0];
+    v = result[1];
+}
+
+
+PsdCalibration::PsdCalibration() {
+    Clear();
+}
+
+void PsdCalibration::Clear() {
+    memset(&data, 0, sizeof(data));
+    memset(&store, 0, sizeof(store));
+    valid = false;
+}
+
+// Rounds to int16 for the stored map, false if out of range
+static bool PackInt16(double value, int16_t &packed) {
+    long rounded = lround(value);
+    if (rounded < INT16_MIN || rounded > INT16_MAX) {
+        return false;
+    }
+    packed = (int16_t)rounded;
+    return true;
+}
+
+/*------------------------------------------------------------------------------
+ * PsdCalibration::Build
+ *
+ *    Inverts a raster into the map and packs it for storage. The map covers
+ *    the u range between the first and last raster columns and the v range
+ *    between the first and last raster rows. Fails if the X motor does not
+ *    mainly move u and the Y motor mainly move v, if a map point cannot be
+ *    solved or if the map does not fit the stored form.
+ *
+ * Parameters:
+ *    const CalibrationRaster &raster  - Measured raster
+ *
+ * Returns: True if the map was built
+ -----------------------------------------------------------------------------*/
+bool PsdCalibration::Build(const CalibrationRaster &raster) {
+    Clear();
+
+    double firstU = 0, lastU = 0, firstV = 0, lastV = 0;
+    for (int k = 0; k < calGridSize; k++) {
+        firstU += raster.u[k][0] / calGridSize;
+        lastU += raster.u[k][calGridSize - 1] / calGridSize;
+        firstV += raster.v[0][k] / calGridSize;
+        lastV += raster.v[calGridSize - 1][k] / calGridSize;
+    }
+    double uPerStepX = (raster.u[calCenter][calCenter + 1] - raster.u[calCenter][calCenter - 1]) / (2.0 * calStepSpacing);
+    double uPerStepY = (raster.u[calCenter + 1][calCenter] - raster.u[calCenter - 1][calCenter]) / (2.0 * calStepSpacing);
+    double vPerStepX = (raster.v[calCenter][calCenter + 1] - raster.v[calCenter][calCenter - 1]) / (2.0 * calStepSpacing);
+    double vPerStepY = (raster.v[calCenter + 1][calCenter] - raster.v[calCenter - 1][calCenter]) / (2.0 * calStepSpacing);
+    if (fabs(uPerStepX) <= fabs(uPerStepY) || fabs(vPerStepY) <= fabs(vPerStepX)) {
+        return false;
+    }
+
+    PsdCalibrationStore packed;
+    packed.version = calVersion;
+    if (!PackInt16(fmin(firstU, lastU) * calUnitsPerU, packed.uStart) ||
+        !PackInt16(fabs(lastU - firstU) / (calMapSize - 1) * calUnitsPerU, packed.uSpacing) ||
+        !PackInt16(fmin(firstV, lastV) * calUnitsPerU, packed.vStart) ||
+        !PackInt16(fabs(lastV - firstV) / (calMapSize - 1) * calUnitsPerU, packed.vSpacing)) {
+        return false;
+    }
+    // Solve at the grid points as they are stored
+    double uStart = packed.uStart / calUnitsPerU, uSpacing = packed.uSpacing / calUnitsPerU;
+    double vStart = packed.vStart / calUnitsPerU, vSpacing = packed.vSpacing / calUnitsPerU;
+
+    double solvedX[calMapSize][calMapSize], solvedY[calMapSize][calMapSize];
+    double sx = 0, sy = 0;
+    for (int j = 0; j < calMapSize; j++) {
+        for (int i = 0; i < calMapSize; i++) {
+            double targetU = uStart + i * uSpacing;
+            double targetV = vStart + j * vSpacing;
+            bool solved = false;
+
+            // Start from the previous point, neighbours are close together
+            for (int iteration = 0; iteration < 20 && !solved; iteration++) {
+                double u, v, jacobian[2][2];
+                RasterForward(raster, sx, sy, u, v, jacobian);
+                double errorU = targetU - u, errorV = targetV - v;
+                double determinant = jacobian[0][0] * jacobian[1][1] - jacobian[0][1] * jacobian[1][0];
+                if (determinant == 0) {
+                    break;
+                }
+                double stepX = (jacobian[1][1] * errorU - jacobian[0][1] * errorV) / determinant;
+                double stepY = (jacobian[0][0] * errorV - jacobian[1][0] * errorU) / determinant;
+                sx += stepX;
+                sy += stepY;
+                solved = fabs(stepX) < 0.5 && fabs(stepY) < 0.5;
+            }
+            if (!solved || fabs(sx) > INT16_MAX || fabs(sy) > INT16_MAX) {
+                return false;
+            }
+            solvedX[j][i] = sx;
+            solvedY[j][i] = sy;
+        }
+    }
+
+    // Linear part from the mean step between the first and last column/row
+    double spanX = 0, spanY = 0;
+    for (int k = 0; k < calMapSize; k++) {
+        spanX += solvedX[k][calMapSize - 1] - solvedX[k][0];
+        spanY += solvedY[calMapSize - 1][k] - solvedY[0][k];
+    }
+    if (!PackInt16(spanX / (calMapSize * (calMapSize - 1)), packed.stepsPerColumn) ||
+        !PackInt16(spanY / (calMapSize * (calMapSize - 1)), packed.stepsPerRow)) {
+        return false;
+    }
+    for (int j = 0; j < calMapSize; j++) {
+        for (int i = 0; i < calMapSize; i++) {
+            long residualX = lround((solvedX[j][i] - packed.stepsPerColumn * (i - mapCenter)) / calResidualScale);
+            long residualY = lround((solvedY[j][i] - packed.stepsPerRow * (j - mapCenter)) / calResidualScale);
+            if (labs(residualX) > INT8_MAX || labs(residualY) > INT8_MAX) {
+                return false;
+            }
+            packed.residualX[j][i] = (int8_t)residualX;
+            packed.residualY[j][i] = (int8_t)residualY;
+        }
+    }
+
+    packed.checksum = Checksum(packed);
+    return Load(packed);
+}
+
+bool PsdCalibration::Load(const PsdCalibrationStore &stored) {
+    Clear();
+    if (stored.version != calVersion || stored.checksum != Checksum(stored) ||
+        stored.uSpacing <= 0 || stored.vSpacing <= 0 ||
+        stored.stepsPerColumn == 0 || stored.stepsPerRow == 0) {
+        return false;
+    }
+    store = stored;
+    data.size = calMapSize;
+    data.uStart = stored.uStart / calUnitsPerU;
+    data.uSpacing = stored.uSpacing / calUnitsPerU;
+    data.vStart = stored.vStart / calUnitsPerU;
+    data.vSpacing = stored.vSpacing / calUnitsPerU;
+    // x_mm = 10*(VX-5)/(2*SUM) = 5*u
+    data.mmPerStepX = 5.0f * data.uSpacing / stored.stepsPerColumn;
+    data.mmPerStepY = 5.0f * data.vSpacing / stored.stepsPerRow;
+    for (int j = 0; j < calMapSize; j++) {
+        for (int i = 0; i < calMapSize; i++) {
+            data.stepsX[j][i] = (int16_t)(stored.stepsPerColumn * (i - mapCenter) +
+                                          stored.residualX[j][i] * calResidualScale);
+            data.stepsY[j][i] = (int16_t)(stored.stepsPerRow * (j - mapCenter) +
+                                          stored.residualY[j][i] * calResidualScale);
+        }
+    }
+    valid = true;
+    return true;
+}
+
+/*------------------------------------------------------------------------------
+ * PsdCalibration::Lookup
+ *
+ *    Bilinear interpolation of the map. Outside the calibrated area the edge
+ *    cells are extrapolated.
+ -----------------------------------------------------------------------------*/
+void PsdCalibration::Lookup(float u, float v, float &stepsX, float &stepsY) const {
+    float tx, ty;
+    int i = Cell((u - data.uStart) / data.uSpacing, calMapSize, tx);
+    int j = Cell((v - data.vStart) / data.vSpacing, calMapSize, ty);
+
+    float x0 = data.stepsX[j][i] + tx * (data.stepsX[j][i + 1] - data.stepsX[j][i]);
+    float x1 = data.stepsX[j + 1][i] + tx * (data.stepsX[j + 1][i + 1] - data.stepsX[j + 1][i]);
+    float y0 = data.stepsY[j][i] + tx * (data.stepsY[j][i + 1] - data.stepsY[j][i]);
+    float y1 = data.stepsY[j + 1][i] + tx * (data.stepsY[j + 1][i + 1] - data.stepsY[j + 1][i]);
+    stepsX = x0 + ty * (x1 - x0);
+    stepsY = y0 + ty * (y1 - y0);
+}
+
+/*------------------------------------------------------------------------------
+ * PsdCalibration::Correction
+ *
+ *    Steps for each motor that move the spot from the input position back to
+ *    the level position. Both positions are normalized by the current SUM.
+ *
+ * Parameters:
+ *    double inputX, inputY   - Averaged X and Y voltages
+ *    double levelX, levelY   - Level X and Y voltages
+ *    double inputSum         - Averaged SUM voltage
+ *    int32_t &stepsX, &stepsY - Receives the move for each motor
+ -----------------------------------------------------------------------------*/
+void PsdCalibration::Correction(double inputX, double inputY, double levelX, double levelY,
+                                double inputSum, int32_t &stepsX, int32_t &stepsY) const {
+    float scale = 1.0f / (float)inputSum;
+    float inputStepsX, inputStepsY, levelStepsX, levelStepsY;
+    Lookup((float)(inputX - 5.0) * scale, (float)(inputY - 5.0) * scale, inputStepsX, inputStepsY);
+    Lookup((float)(levelX - 5.0) * scale, (float)(levelY - 5.0) * scale, levelStepsX, levelStepsY);
+    stepsX = (int32_t)lroundf(levelStepsX - inputStepsX);
+    stepsY = (int32_t)lroundf(levelStepsY - inputStepsY);
+}
+
+// CRC-8 (polynomial 0x07) over everything in the map except the checksum
+// itself, which catches every single bit error
+uint8_t PsdCalibration::Checksum(const PsdCalibrationStore &map) {
+    const uint8_t *bytes = (const uint8_t *)&map;
+    uint8_t crc = 0;
+    for (unsigned i = 0; i < sizeof(map); i++) {
+        if (bytes + i == &map.checksum) {
+            continue;
+        }
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
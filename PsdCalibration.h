@@ -0,0 +1,121 @@
+/*==========================================================
+; File Name: PsdCalibration.h
+;
+; Description:
+; Nonlinearity correction for the lateral effect sensor. A calibration
+; raster moves the stage to a square grid of known step positions and
+; records the normalized spot position u = (VX-5)/SUM, v = (VY-5)/SUM
+; at each one. That raster is inverted into a map from (u, v) back to
+; stage steps on a regular grid, which is stored on the ClearCore and
+; read with bilinear interpolation to turn a voltage error into the
+; number of steps that removes it. The stored form is packed into the
+; 64 byte user area of the ClearCore NVM.
+;
+; This file does not depend on ClearCore so it can also be built on a PC.
+;
+;========================================================== */
+
+#ifndef PSD_CALIBRATION_H
+#define PSD_CALIBRATION_H
+
+#include <stdint.h>
+
+// Number of raster points along each axis, must be odd
+const int calGridSize = 7;
+// Steps between raster points, the raster covers +/-3 spacings around center
+const int32_t calStepSpacing = 1500;
+// Number of map points along each axis
+const int calMapSize = 5;
+// Identifies a stored map, change the version when the layout changes.
+// Erased NVM reads back as 0x00 or 0xFF.
+const uint8_t calVersion = 0xC3;
+// Stored u and v values are in units of 1/calUnitsPerU
+const float calUnitsPerU = 10000.0f;
+// Steps per count of the stored residuals
+const int calResidualScale = 8;
+
+
+/*------------------------------------------------------------------------------
+ * CalibrationRaster
+ *
+ *    Normalized spot positions measured at each raster point. Point [j][i]
+ *    is at X steps (i - calGridSize/2) * calStepSpacing and Y steps
+ *    (j - calGridSize/2) * calStepSpacing from the starting position.
+ -----------------------------------------------------------------------------*/
+struct CalibrationRaster {
+    float u[calGridSize][calGridSize];
+    float v[calGridSize][calGridSize];
+};
+
+
+/*------------------------------------------------------------------------------
+ * PsdCalibrationData
+ *
+ *    The map as used for lookups. stepsX/stepsY[j][i] is the stage position
+ *    (in steps from the raster center) that puts the spot at
+ *    u = uStart + i * uSpacing, v = vStart + j * vSpacing.
+ -----------------------------------------------------------------------------*/
+struct PsdCalibrationData {
+    uint16_t size;
+    float uStart, uSpacing;
+    float vStart, vSpacing;
+    // Slope of the linear 10*(V-5)/(2*SUM) formula, for the scripts
+    float mmPerStepX, mmPerStepY;
+    int16_t stepsX[calMapSize][calMapSize];
+    int16_t stepsY[calMapSize][calMapSize];
+};
+
+
+/*------------------------------------------------------------------------------
+ * PsdCalibrationStore
+ *
+ *    Packed form of the map kept in NVM. The steps are stored as a linear
+ *    part, stepsPerColumn * (i - calMapSize/2) for X and
+ *    stepsPerRow * (j - calMapSize/2) for Y, plus a residual in
+ *    calResidualScale steps that holds the sensor nonlinearity and any
+ *    coupling between the axes.
+ -----------------------------------------------------------------------------*/
+struct PsdCalibrationStore {
+    uint8_t version;
+    uint8_t checksum;
+    int16_t uStart, uSpacing;
+    int16_t vStart, vSpacing;
+    int16_t stepsPerColumn, stepsPerRow;
+    int8_t residualX[calMapSize][calMapSize];
+    int8_t residualY[calMapSize][calMapSize];
+};
+
+
+/*------------------------------------------------------------------------------
+ * PsdCalibration
+ *
+ *    Builds, validates and applies the correction map.
+ -----------------------------------------------------------------------------*/
+class PsdCalibration {
+public:
+    PsdCalibration();
+
+    void Clear();
+    bool Build(const CalibrationRaster &raster);
+    // Accepts a map read back from storage if its version and checksum match
+    bool Load(const PsdCalibrationStore &stored);
+    bool Valid() const { return valid; }
+    const PsdCalibrationData &Data() const { return data; }
+    // Packed map to write to storage
+    const PsdCalibrationStore &Stored() const { return store; }
+
+    // Stage position in steps for a normalized spot position
+    void Lookup(float u, float v, float &stepsX, float &stepsY) const;
+    // Steps that move the spot from the input voltages to the level voltages
+    void Correction(double inputX, double inputY, double levelX, double levelY,
+                    double inputSum, int32_t &stepsX, int32_t &stepsY) const;
+
+private:
+    static uint8_t Checksum(const PsdCalibrationStore &map);
+
+    PsdCalibrationData data;
+    PsdCalibrationStore store;
+    bool valid;
+};
+
+#endif // PSD_CALIBRATION_H
@@ -15,6 +15,12 @@
 ;========================================================== */
 
 #include "ClearCore.h"
+#include "VibrationAnalysis.h"
+#include "Telemetry.h"
+#include "PsdCalibration.h"
+#include "LevelingMath.h"
+#include "MotorHold.h"
+#include "LevelingSchedule.h"
 
 // Stepper motor set up:
 // Options are: ConnectorM0, ConnectorM1, ConnectorM2, or ConnectorM3.
@@ -31,9 +37,49 @@
 // To disable automatic alert handling, #define HANDLE_ALERTS (0)
 #define HANDLE_ALERTS (1)
 #define inputPin ConnectorIO5
+// Holding the calibration switch on at power up rasters the stage across the
+//  sensor and stores a new PSD calibration map. Center the laser on the sensor
+//  first, the raster covers +/-3*calStepSpacing steps on each axis.
+#define calibratePin ConnectorIO4
+#define SerialPort ConnectorUsb //serial data is sent over the USB port
+// Vibration filtering samples the raw X and Y signals at 500Hz between the
+//  averaged readings, finds periodic vibration with an FFT and removes it with
+//  notch filters before the values reach the leveling average. The spectrum
+//  of each axis is sent over serial every few seconds.
+// To enable vibration filtering, #define VIBRATION_FILTERING (1)
+// To disable vibration filtering, #define VIBRATION_FILTERING (0)
+#define VIBRATION_FILTERING (1)
+// Number of FFT windows between spectrum lines sent over serial
+#define SPECTRUM_REPORT_WINDOWS (8)
+// Motor hold mode de-energizes each axis once it has been idle for
+//  holdSettleMs while leveling, which removes the holding current heat near
+//  the sample. An axis is re-enabled (waiting for HLFB) before a correction,
+//  or early when its error gets close to the tolerance.
+// WARNING: a de-energized axis has no holding torque, only use this mode if
+//  the adjustment screws do not back drive.
+// To enable motor hold mode, #define MOTOR_HOLD_MODE (1)
+// To disable motor hold mode, #define MOTOR_HOLD_MODE (0)
+#define MOTOR_HOLD_MODE (0)
+// Number of averaged readings between motor hold lines sent over serial
+#define HOLD_REPORT_READINGS (40)
+// Gain scheduling switches leveling between a coarse regime (short average,
+//  fast moves, corrections with a gain above one to lead the drift) while
+//  the sample is heating and a fine regime (long average, gentle moves,
+//  tighter tolerance than the fixed loop) during the isothermal hold, see
+//  LevelingSchedule.h for the settings.
+// To enable gain scheduling, #define GAIN_SCHEDULING (1)
+// To disable gain scheduling, #define GAIN_SCHEDULING (0)
+#define GAIN_SCHEDULING (1)
+// The PSD calibration map is kept in the user area at the end of the 512
+//  byte ClearCore NVM
+const int nvmUserEnd = 512;
+static_assert(NvmManager::NVM_LOC_USER_START + sizeof(PsdCalibrationStore) <= nvmUserEnd,
+              "PSD calibration map does not fit in the user NVM area");
 // Define the velocity and acceleration limits to be used for each move
 const int32_t velocityLimit = 10000; // 10000pulses per sec
 const int32_t accelerationLimit = 10000; //50000 pulses per sec^2
+// Leveling settings used when gain scheduling is off and between leveling runs
+const LevelingRegime fixedRegime = {"FIXED", 1.5E-2, 1.0, 10, velocityLimit, accelerationLimit};
 
 
 //ADC Set up:
@@ -43,12 +89,38 @@ const int32_t accelerationLimit = 10000; //50000 pulses per sec^2
 
 int16_t leveling; // State of input switch
 
+//Vibration analysis of the raw X and Y signals
+VibrationChannel vibrationX;
+VibrationChannel vibrationY;
+uint32_t lastVibrationSampleUs = 0; // time of the last raw sample
+uint32_t spectrumWindows = 0; // FFT windows since the last spectrum report
+char telemetryLine[telemetryLineSize];
+
+//PSD nonlinearity correction, used for step counts when a map is stored
+PsdCalibration calibration;
+
+//Motor hold mode state for each axis
+AxisHold holdX;
+AxisHold holdY;
+uint32_t holdReadings = 0; // averaged readings since the last hold report
+
+//Coarse/fine regime selection while leveling
+LevelingSchedule schedule;
+
 
 // Declares user-defined helper functions.
 void MoveDistanceX(int32_t distance);
 void MoveDistanceY(int32_t distance);
 void HandleAlertsY();
 void HandleAlertsX();
+void SampleVibration(uint32_t duration);
+void RunCalibration();
+void SendCalibration();
+bool EnableAxis(MotorDriver &motor);
+bool WakeAxis(MotorDriver &motor, AxisHold &hold, bool delayedCorrection);
+void HoldAxis(MotorDriver &motor, AxisHold &hold, bool nearTolerance);
+void SendHoldReport();
+void ApplyRegime(const LevelingRegime &regime, double driftRate);
 
 
 /*------------------------------------------------------------------------------
@@ -58,6 +130,9 @@ void HandleAlertsX();
  *	  checks if laser position is within x and y tolerance
  *    calls move motor if out of tolerance, alternates starting with x and y
  *    adjusts every 0.75 second.
+ *    Each averaged reading is sent over serial for EllipData.py.
+ *    Step counts come from the PSD calibration map when one is stored,
+ *    otherwise from the linear deltaX/deltaY gains.
  *    
  *
  * Parameters:
@@ -71,6 +146,7 @@ void HandleAlertsX();
     // Set the resolution of the ADC.
     AdcMgr.AdcResolution(adcResolution);
 	inputPin.Mode(Connector::INPUT_DIGITAL);
+	calibratePin.Mode(Connector::INPUT_DIGITAL);
 	
 	//Motor config
 	MotorMgr.MotorInputClocking(MotorManager::CLOCK_RATE_NORMAL);
@@ -86,20 +162,40 @@ void HandleAlertsX();
 	motorX.EnableRequest(false);
 	motorY.EnableRequest(false);
 	
+	//Serial config, the averaged readings and spectra are logged by EllipData.py
+	SerialPort.Mode(Connector::USB_CDC);
+	SerialPort.Speed(9600);
+	SerialPort.PortOpen();
+	FormatSampleHeader(telemetryLine, telemetryLineSize);
+	SerialPort.SendLine(telemetryLine);
+	
+	//Vibration analysis config
+	vibrationX.Init(10.0f / ((1 << adcResolution) - 1));
+	vibrationY.Init(10.0f / ((1 << adcResolution) - 1));
+	
+	//Load the stored PSD calibration map, or make a new one if requested
+	PsdCalibrationStore storedMap;
+	NvmMgr.BlockRead(NvmManager::NVM_LOC_USER_START, sizeof(storedMap), (uint8_t *)&storedMap);
+	calibration.Load(storedMap);
+	if (calibratePin.State())
+	{
+		RunCalibration();
+	}
+	SendCalibration();
 
-    double inputVoltageSUM, inputVoltageY, inputVoltageX, SumX, SumY, SumSum, voltageX, voltageY, voltageSum = 0.0; //tracks voltages
-    bool LevelFlag, ledState = false;	//Used to set level position of first iteration of loop
-    double LevelX, LevelY, Xpos, Ypos = 0.0; //used to track the desired voltages when leveling is activated
+    double inputVoltageSUM, inputVoltageY, inputVoltageX, voltageX, voltageY, voltageSum = 0.0; //tracks voltages
+    VoltageAverage average; //sums of the voltage samples
+    bool LevelFlag = false, ledState = false;	//Used to set level position of first iteration of loop
+    double LevelX = 0.0, LevelY = 0.0, Xpos = 0.0, Ypos = 0.0; //used to track the desired voltages when leveling is activated
 	double delay = 75; //Sets the amount of time in milliseconds before the next sample
-	int num_samples = 10; //Sets the number of samples taken for the average
-	int count = 0; //takes 10 samples then computes the average
-	const double Xtol = 1.5E-2; // X axis tolerance
-	const double Ytol = 1.5E-2; // Y axis tolerance
-	const double deltaY = 2E-4; // Steps for smallest delta voltage
-	const double deltaX = 2E-4; // Steps for smallest delta voltage
+	int count = 0; //takes regime.numSamples samples then computes the average
+	LevelingRegime regime = fixedRegime; //tolerance, gain, averaging and motion limits in use
+	bool scheduling = false; //true while the schedule is picking the regime
 	
     int16_t adcSUM, adcY, adcX = 0; //adc read values
  
+	SampleVibration(delay); //fill the notch filters before the first reading
+	
     while (true) {
 		
 		//update the leveling switch state
@@ -109,38 +205,56 @@ void HandleAlertsX();
 		
         adcSUM = ConnectorA12.State();
         // Convert the reading to a voltage.
-        voltageSum = 10.0 * adcSUM / ((1 << adcResolution) - 1);
+        voltageSum = AdcToVoltage(adcSUM, adcResolution);
         
         adcY = ConnectorA10.State();
         // Convert the reading to a voltage.
-        voltageY = 10.0 * adcY / ((1 << adcResolution) - 1);
+        voltageY = AdcToVoltage(adcY, adcResolution);
         
         adcX = ConnectorA11.State();
         // Convert the reading to a voltage.
-        voltageX = 10.0 * adcX / ((1 << adcResolution) - 1);
+        voltageX = AdcToVoltage(adcX, adcResolution);
+		
+		if (VIBRATION_FILTERING)
+		{	//Use the notch filtered X and Y voltages from the vibration sampling
+			voltageX = vibrationX.Output();
+			voltageY = vibrationY.Output();
+		}
 		
 		//Collect 10 voltage samples for Sum, X, and Y
-		SumX += voltageX;
-		SumY += voltageY;
-		SumSum += voltageSum;
+		average.Add(voltageX, voltageY, voltageSum);
 		
-		if(count == num_samples)
+		if(count >= regime.numSamples)
 		{
 			//Compute the average for each voltage and set sum back to zero
-			inputVoltageX = SumX/num_samples;
-			inputVoltageY = SumY/num_samples;
-			inputVoltageSUM =  SumSum/num_samples;
-			SumY = 0;
-			SumX = 0;
-			SumSum = 0;
+			average.Take(count, inputVoltageX, inputVoltageY, inputVoltageSUM);
 			count = 0;
+			
+			FormatSampleLine(telemetryLine, telemetryLineSize, Milliseconds(), LevelX, LevelY,
+			                 inputVoltageX, inputVoltageY, inputVoltageSUM);
+			SerialPort.SendLine(telemetryLine);
 
 			if (leveling) 
 			{	//Once switch has been set to the on position the bed is level, enter automated leveling state
 				
 				//enable motors when leveling, this will disable manual adjustments and turn on motors.
-				motorX.EnableRequest(true);
-				motorY.EnableRequest(true);
+				//In motor hold mode this is only done when leveling starts.
+				if (!MOTOR_HOLD_MODE || !holdX.Active())
+				{
+					motorX.EnableRequest(true);
+					motorY.EnableRequest(true);
+					if (MOTOR_HOLD_MODE)
+					{
+						holdX.Start(Milliseconds());
+						holdY.Start(Milliseconds());
+					}
+				}
+				
+				if (MOTOR_HOLD_MODE && ++holdReadings >= HOLD_REPORT_READINGS)
+				{
+					holdReadings = 0;
+					SendHoldReport();
+				}
 				
 				Xpos = inputVoltageX;	//New laser position for X
 				Ypos = inputVoltageY;	//New laser position for Y
@@ -157,21 +271,52 @@ void HandleAlertsX();
 					LevelX = inputVoltageX;	//Set LevelX sensor position
 					LevelY = inputVoltageY;	//Set LevelY sensor position
 					LevelFlag = true; //set flag to true as to not rewrite the leveled voltages
+					
+					if (GAIN_SCHEDULING)
+					{	//Start the run in the coarse regime
+						schedule.Reset(Milliseconds());
+						scheduling = true;
+						regime = schedule.Regime();
+						ApplyRegime(regime, schedule.DriftRate());
+					}
 				}
 
 				else 
 				{
+					if (GAIN_SCHEDULING && schedule.Update(Milliseconds(), Xpos - LevelX, Ypos - LevelY))
+					{	//Drift rate or error moved the run into the other regime
+						regime = schedule.Regime();
+						ApplyRegime(regime, schedule.DriftRate());
+					}
+					
 					//Make X and Y adjustments if new x or y position is not within tolerance of the leveled values
+					LevelingMove move = RegimeMove(regime, calibration, LevelX, LevelY, Xpos, Ypos, inputVoltageSUM);
 					
-					if ((Xpos > (LevelX + Xtol)) || (Xpos < (LevelX - Xtol))) 
-					{ // If Xpos is greater than LevelX + Xtol or less than LevelX - Xtol
-						MoveDistanceX(int32_t((LevelX - Xpos) / deltaX));
+					if (move.moveX) 
+					{ // If Xpos is greater than LevelX + tolerance or less than LevelX - tolerance
+						if (WakeAxis(motorX, holdX, true))
+						{	//Not moved if the motor did not come up, retried on the next reading
+							MoveDistanceX(move.stepsX);
+							holdX.Activity(Milliseconds());
+							schedule.Corrected((LevelX - Xpos) * regime.gain, 0);
+						}
 					} 
 					
-					if ((Ypos > (LevelY + Ytol))|| Ypos < (LevelY - Ytol)) 
-					{ // If Ypos is greater than LevelY + Ytol or less than LevelY - Ytol
-						MoveDistanceY(int32_t((Ypos - LevelY) / deltaY));
+					if (move.moveY) 
+					{ // If Ypos is greater than LevelY + tolerance or less than LevelY - tolerance
+						if (WakeAxis(motorY, holdY, true))
+						{
+							MoveDistanceY(move.stepsY);
+							holdY.Activity(Milliseconds());
+							schedule.Corrected(0, (LevelY - Ypos) * regime.gain);
+						}
 					} 
+					
+					if (MOTOR_HOLD_MODE)
+					{	//Release idle axes, wake axes whose error is close to the tolerance
+						HoldAxis(motorX, holdX, OutOfTolerance(Xpos, LevelX, holdWakeFraction * regime.tolerance));
+						HoldAxis(motorY, holdY, OutOfTolerance(Ypos, LevelY, holdWakeFraction * regime.tolerance));
+					}
 				
 				} 
 			}
@@ -180,13 +325,27 @@ void HandleAlertsX();
 			{
 				LevelFlag = false; //If switch is off reset LevelFlag
 				
+				if (scheduling)
+				{	//Back to the fixed settings between leveling runs
+					scheduling = false;
+					regime = fixedRegime;
+					ApplyRegime(regime, 0);
+				}
+				
+				if (MOTOR_HOLD_MODE && holdX.Active())
+				{	//End of the leveling run, send the final hold statistics
+					holdX.Stop(Milliseconds());
+					holdY.Stop(Milliseconds());
+					SendHoldReport();
+				}
+				
 				//Disable motors to allow for manual adjustment
 				motorX.EnableRequest(false);
 				motorY.EnableRequest(false);
 			} 
 		}
-		count += 1;			//increase count to take 10 samples
-		Delay_ms(delay);		// Wait a .075 second before the next reading.
+		count += 1;			//increase count to take regime.numSamples samples
+		SampleVibration(delay);		// Wait a .075 second before the next reading.
 	}
 }
  
@@ -250,6 +409,296 @@ void MoveDistanceY(int32_t distance) {
     }
 }
 
+/*------------------------------------------------------------------------------
+ * SampleVibration
+ *
+ *    Waits "duration" milliseconds between averaged readings. While waiting
+ *    the raw X and Y signals are sampled every vibrationSamplePeriodUs and fed
+ *    to the notch filters and FFT windows. Full windows are analyzed here,
+ *    which retunes the notches, and every SPECTRUM_REPORT_WINDOWS windows the
+ *    spectra are sent over serial. A gap in sampling (for example during a
+ *    move) restarts the FFT windows so they only hold evenly spaced samples.
+ *
+ * Parameters:
+ *    uint32_t duration  - Time to wait in milliseconds
+ *
+ * Returns: Nothing
+ -------------------------------------------------------------------------------*/
+void SampleVibration(uint32_t duration) {
+	if (!VIBRATION_FILTERING)
+	{
+		Delay_ms(duration);
+		return;
+	}
+	
+	uint32_t start = Milliseconds();
+	while (Milliseconds() - start < duration)
+	{
+		uint32_t now = Microseconds();
+		if (now - lastVibrationSampleUs < vibrationSamplePeriodUs)
+		{
+			continue;
+		}
+		
+		if (now - lastVibrationSampleUs > 2 * vibrationSamplePeriodUs)
+		{	//Missed samples, start new windows from here
+			vibrationX.Restart();
+			vibrationY.Restart();
+			lastVibrationSampleUs = now;
+		}
+		else
+		{
+			lastVibrationSampleUs += vibrationSamplePeriodUs;
+		}
+		
+		vibrationX.Update(ConnectorA11.State());
+		vibrationY.Update(ConnectorA10.State());
+		
+		if (vibrationX.WindowReady() && vibrationY.WindowReady())
+		{
+			vibrationX.Analyze();
+			vibrationY.Analyze();
+			
+			if (++spectrumWindows >= SPECTRUM_REPORT_WINDOWS)
+			{
+				spectrumWindows = 0;
+				FormatSpectrumLine(telemetryLine, telemetryLineSize, Milliseconds(), 'X', vibrationX);
+				SerialPort.SendLine(telemetryLine);
+				FormatSpectrumLine(telemetryLine, telemetryLineSize, Milliseconds(), 'Y', vibrationY);
+				SerialPort.SendLine(telemetryLine);
+			}
+		}
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * RunCalibration
+ *
+ *    Moves the stage over a calGridSize x calGridSize raster of known step
+ *    positions around the current position (back and forth along the rows to
+ *    keep moves short) and averages the X, Y and SUM voltages at each point.
+ *    The raster is turned into a calibration map which is stored in NVM.
+ *    The stage returns to its starting position when done. If the laser
+ *    leaves the sensor, or a motor does not assert HLFB when enabled, the
+ *    calibration is abandoned and the old map is kept.
+ *
+ * Parameters:
+ *    None
+ *
+ * Returns: Nothing
+ -------------------------------------------------------------------------------*/
+void RunCalibration() {
+	const uint32_t settleTime = 500; //ms to wait after each move
+	const int calSamples = 50; //samples averaged at each raster point
+	const int center = calGridSize / 2;
+	CalibrationRaster raster;
+	int32_t positionX = 0, positionY = 0;
+	bool laserLost = false;
+	
+	if (!EnableAxis(motorX) || !EnableAxis(motorY))
+	{	//Steps sent before HLFB asserts are lost and would offset the raster
+		motorX.EnableRequest(false);
+		motorY.EnableRequest(false);
+		SerialPort.SendLine("CAL,FAILED");
+		return;
+	}
+	
+	for (int j = 0; j < calGridSize && !laserLost; j++)
+	{
+		for (int n = 0; n < calGridSize && !laserLost; n++)
+		{
+			int i = (j % 2 == 0) ? n : calGridSize - 1 - n;
+			int32_t targetX = (i - center) * calStepSpacing;
+			int32_t targetY = (j - center) * calStepSpacing;
+			MoveDistanceX(targetX - positionX);
+			MoveDistanceY(targetY - positionY);
+			positionX = targetX;
+			positionY = targetY;
+			Delay_ms(settleTime);
+			
+			double sumX = 0, sumY = 0, sumSum = 0;
+			for (int k = 0; k < calSamples; k++)
+			{
+				sumX += AdcToVoltage(ConnectorA11.State(), adcResolution);
+				sumY += AdcToVoltage(ConnectorA10.State(), adcResolution);
+				sumSum += AdcToVoltage(ConnectorA12.State(), adcResolution);
+				Delay_ms(10);
+			}
+			double voltageSum = sumSum / calSamples;
+			laserLost = voltageSum < 2.5; //same check as leveling
+			raster.u[j][i] = float((sumX / calSamples - 5.0) / voltageSum);
+			raster.v[j][i] = float((sumY / calSamples - 5.0) / voltageSum);
+		}
+	}
+	
+	MoveDistanceX(-positionX);
+	MoveDistanceY(-positionY);
+	motorX.EnableRequest(false);
+	motorY.EnableRequest(false);
+	
+	PsdCalibration newMap;
+	if (!laserLost && newMap.Build(raster))
+	{
+		calibration = newMap;
+		NvmMgr.BlockWrite(NvmManager::NVM_LOC_USER_START, sizeof(PsdCalibrationStore),
+		                  (const uint8_t *)&calibration.Stored());
+	}
+	else
+	{
+		SerialPort.SendLine("CAL,FAILED");
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * SendCalibration
+ *
+ *    Sends the current calibration map over serial so the analysis scripts
+ *    can apply the same correction. Sends "CAL,NONE" if there is no map.
+ *
+ * Parameters:
+ *    None
+ *
+ * Returns: Nothing
+ -------------------------------------------------------------------------------*/
+void SendCalibration() {
+	if (!calibration.Valid())
+	{
+		SerialPort.SendLine("CAL,NONE");
+		return;
+	}
+	FormatCalibrationHeader(telemetryLine, telemetryLineSize, calibration.Data());
+	SerialPort.SendLine(telemetryLine);
+	for (int row = 0; row < calMapSize; row++)
+	{
+		FormatCalibrationRow(telemetryLine, telemetryLineSize, calibration.Data(), row);
+		SerialPort.SendLine(telemetryLine);
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * EnableAxis
+ *
+ *    Enables a motor and waits for HLFB to assert, which signals the motor
+ *    is enabled and ready to take steps. Steps sent before that would be
+ *    lost. If HLFB does not assert within hlfbEnableTimeoutMs the motor is
+ *    disabled again.
+ *
+ * Parameters:
+ *    MotorDriver &motor      - Motor to enable
+ *
+ * Returns: True if the motor is ready for steps
+ -------------------------------------------------------------------------------*/
+bool EnableAxis(MotorDriver &motor) {
+	uint32_t startMs = Milliseconds();
+	motor.EnableRequest(true);
+	while (motor.HlfbState() != MotorDriver::HLFB_ASSERTED &&
+	       Milliseconds() - startMs < hlfbEnableTimeoutMs) {
+		continue;
+	}
+	if (motor.HlfbState() != MotorDriver::HLFB_ASSERTED)
+	{
+		motor.EnableRequest(false);
+		return false;
+	}
+	return true;
+}
+
+/*------------------------------------------------------------------------------
+ * WakeAxis
+ *
+ *    Re-enables an axis released by motor hold mode with EnableAxis. The
+ *    time this takes is recorded as the latency of the wake. If HLFB does
+ *    not assert in time the timeout is counted, the next wake tries again. Does nothing if the axis is
+ *    energized or hold mode is off.
+ *
+ * Parameters:
+ *    MotorDriver &motor      - Motor to enable
+ *    AxisHold &hold          - Hold state of the motor
+ *    bool delayedCorrection  - True if a move is waiting on the motor
+ *
+ * Returns: True if the motor is ready for steps
+ -------------------------------------------------------------------------------*/
+bool WakeAxis(MotorDriver &motor, AxisHold &hold, bool delayedCorrection) {
+	if (!MOTOR_HOLD_MODE || hold.Energized())
+	{
+		return true;
+	}
+	
+	uint32_t startUs = Microseconds();
+	if (!EnableAxis(motor))
+	{
+		hold.WakeTimedOut();
+		return false;
+	}
+	hold.Woken(Milliseconds(), Microseconds() - startUs, delayedCorrection);
+	return true;
+}
+
+/*------------------------------------------------------------------------------
+ * HoldAxis
+ *
+ *    Motor hold mode step for one axis after each leveling decision. An axis
+ *    whose error is close to the tolerance is kept (or made) ready so the
+ *    next correction does not wait on HLFB. Otherwise the axis is
+ *    de-energized once it has been idle for holdSettleMs.
+ *
+ * Parameters:
+ *    MotorDriver &motor  - Motor to hold or release
+ *    AxisHold &hold      - Hold state of the motor
+ *    bool nearTolerance  - True if the error is past holdWakeFraction of the tolerance
+ *
+ * Returns: Nothing
+ -------------------------------------------------------------------------------*/
+void HoldAxis(MotorDriver &motor, AxisHold &hold, bool nearTolerance) {
+	if (nearTolerance)
+	{
+		if (hold.Energized())
+		{
+			hold.Activity(Milliseconds());
+		}
+		else
+		{
+			WakeAxis(motor, hold, false);
+		}
+	}
+	else if (hold.SettleElapsed(Milliseconds()))
+	{
+		motor.EnableRequest(false);
+		hold.Released(Milliseconds());
+	}
+}
+
+/*------------------------------------------------------------------------------
+ * ApplyRegime
+ *
+ *    Sets the motion limits of both motors for a leveling regime and reports
+ *    the change over serial. The tolerance, gain and averaging are read from
+ *    the regime by the leveling loop.
+ *
+ * Parameters:
+ *    const LevelingRegime &regime  - Regime now in use
+ *    double driftRate              - Drift rate that caused the change, in V/s
+ *
+ * Returns: Nothing
+ -------------------------------------------------------------------------------*/
+void ApplyRegime(const LevelingRegime &regime, double driftRate) {
+	motorX.VelMax(regime.velocityLimit);
+	motorY.VelMax(regime.velocityLimit);
+	motorX.AccelMax(regime.accelerationLimit);
+	motorY.AccelMax(regime.accelerationLimit);
+	
+	FormatModeLine(telemetryLine, telemetryLineSize, Milliseconds(), regime.name, driftRate);
+	SerialPort.SendLine(telemetryLine);
+}
+
+// Sends the motor hold duty cycle and latency of both axes over serial
+void SendHoldReport() {
+	FormatHoldLine(telemetryLine, telemetryLineSize, Milliseconds(), 'X', holdX);
+	SerialPort.SendLine(telemetryLine);
+	FormatHoldLine(telemetryLine, telemetryLineSize, Milliseconds(), 'Y', holdY);
+	SerialPort.SendLine(telemetryLine);
+}
+
 /*------------------------------------------------------------------------------
  * HandleAlerts
  *
@@ -277,4 +726,4 @@ void HandleAlertsY(){
 		motorY.EnableRequest(true);
 	}
 	motorY.ClearAlerts();
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -1,19 +1,71 @@
 import pandas as pd
 import matplotlib.pyplot as plt
 import numpy as np
+import os
 
 # === LOAD DATA ===
 df = pd.read_csv("SerialSensorData/Ellip_test10_serial.csv")
 df['PC_Timestamp'] = pd.to_datetime(df['PC_Timestamp'])
 df['Elapsed_Minutes'] = (df['PC_Timestamp'] - df['PC_Timestamp'].iloc[0]).dt.total_seconds() / 60
 
+# PSD calibration map logged by EllipData.py, the linear formula is used if it is missing
+CALIBRATION_FILE = "SerialSensorData/psd_calibration.csv"
+
+# === LOAD PSD CALIBRATION ===
+def load_calibration(path):
+    if not os.path.exists(path):
+        return None
+    header, rows = None, {}
+    with open(path) as f:
+        for line in f:
+            parts = line.strip().split(',')
+            if parts[0] == 'CAL' and len(parts) == 8:
+                header = [float(p) for p in parts[1:]]
+            elif parts[0] == 'CALROW':
+                rows[int(parts[1])] = [float(p) for p in parts[2:]]
+    if header is None:
+        return None
+    size = int(header[0])
+    steps = np.array([rows[j] for j in range(size)])
+    return {
+        'size': size,
+        'u_start': header[1], 'u_spacing': header[2],
+        'v_start': header[3], 'v_spacing': header[4],
+        'mm_per_step_x': header[5], 'mm_per_step_y': header[6],
+        'steps_x': steps[:, 0::2], 'steps_y': steps[:, 1::2],
+    }
+
+# Same bilinear lookup as PsdCalibration::Lookup, scaled to mm with the center slope
+def calibrated_mm(cal, voltage_x, voltage_y, voltage_sum):
+    u = np.asarray((voltage_x - 5) / voltage_sum, dtype=float)
+    v = np.asarray((voltage_y - 5) / voltage_sum, dtype=float)
+    fx = (u - cal['u_start']) / cal['u_spacing']
+    fy = (v - cal['v_start']) / cal['v_spacing']
+    i = np.clip(np.floor(fx).astype(int), 0, cal['size'] - 2)
+    j = np.clip(np.floor(fy).astype(int), 0, cal['size'] - 2)
+    tx, ty = fx - i, fy - j
+    def bilinear(grid):
+        row0 = grid[j, i] + tx * (grid[j, i + 1] - grid[j, i])
+        row1 = grid[j + 1, i] + tx * (grid[j + 1, i + 1] - grid[j + 1, i])
+        return row0 + ty * (row1 - row0)
+    return bilinear(cal['steps_x']) * cal['mm_per_step_x'], bilinear(cal['steps_y']) * cal['mm_per_step_y']
+
+calibration = load_calibration(CALIBRATION_FILE)
+
 # === COMPUTE POSITIONS IN mm ===
-df['x_mm'] = (10 * (df['inputVoltageX'] - 5)) / (2 * df['inputVoltageSUM'])
-df['y_mm'] = (10 * (df['inputVoltageY'] - 5)) / (2 * df['inputVoltageSUM'])
+if calibration is None:
+    df['x_mm'] = (10 * (df['inputVoltageX'] - 5)) / (2 * df['inputVoltageSUM'])
+    df['y_mm'] = (10 * (df['inputVoltageY'] - 5)) / (2 * df['inputVoltageSUM'])
+    level_x_mm = (10 * (df['LevelX'] - 5)) / (2 * df['inputVoltageSUM'])
+    level_y_mm = (10 * (df['LevelY'] - 5)) / (2 * df['inputVoltageSUM'])
+else:
+    print(f"Using PSD calibration map from {CALIBRATION_FILE}")
+    df['x_mm'], df['y_mm'] = calibrated_mm(calibration, df['inputVoltageX'], df['inputVoltageY'], df['inputVoltageSUM'])
+    level_x_mm, level_y_mm = calibrated_mm(calibration, df['LevelX'], df['LevelY'], df['inputVoltageSUM'])
 
 # === CALCULATE CENTER BASED ON LEVEL ===
-x_center = ((10 * (df['LevelX'] - 5)) / (2 * df['inputVoltageSUM'])).mean()
-y_center = ((10 * (df['LevelY'] - 5)) / (2 * df['inputVoltageSUM'])).mean()
+x_center = level_x_mm.mean()
+y_center = level_y_mm.mean()
 
 # === CALCULATE DISTANCE FROM CENTER ===
 df['distance_from_center'] = np.sqrt((df['x_mm'] - x_center)**2 + (df['y_mm'] - y_center)**2)
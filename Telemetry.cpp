@@ -0,0 +1,264 @@
+/*==========================================================
+; File Name: Telemetry.cpp
+;
+; Description:
+; Serial line formatting for the leveling data and vibration spectra.
+;
+;========================================================== */
+
+#include "Telemetry.h"
+#include "VibrationAnalysis.h"
+#include "PsdCalibration.h"
+#include "MotorHold.h"
+#include <stdio.h>
+
+/*------------------------------------------------------------------------------
+ * Append
+ *
+ *    Helpers that append to a line and keep track of the used length. Once
+ *    the line is full further text is dropped.
+ -----------------------------------------------------------------------------*/
+static void AppendUnsigned(char *line, int size, int &length, unsigned long value) {
+    if (length < size) {
+        length += snprintf(line + length, size - length, "%lu", value);
+    }
+}
+
+static void AppendSigned(char *line, int size, int &length, long value) {
+    if (length < size) {
+        length += snprintf(line + length, size - length, "%ld", value);
+    }
+}
+
+static void AppendText(char *line, int size, int &length, const char *text) {
+    if (length < size) {
+        length += snprintf(line + length, size - length, "%s", text);
+    }
+}
+
+// Writes value with a fixed number of decimal places, e.g. 5.369
+static void AppendFixed(char *line, int size, int &length, double value, int decimals) {
+    long scale = 1;
+    for (int i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+    long scaled = (long)(value * scale + (value < 0 ? -0.5 : 0.5));
+    if (scaled < 0) {
+        AppendText(line, size, length, "-");
+        scaled = -scaled;
+    }
+    if (length < size) {
+        length += snprintf(line + length, size - length, "%ld.%0*ld", scaled / scale, decimals, scaled % scale);
+    }
+}
+
+// Keeps the returned length inside the buffer when the text was cut short
+static int Finish(int size, int length) {
+    return length < size ? length : size - 1;
+}
+
+int FormatSampleHeader(char *line, int size) {
+    return Finish(size, snprintf(line, size,
+        "Time_ms,LevelX,LevelY,inputVoltageX,inputVoltageY,inputVoltageSUM"));
+}
+
+/*------------------------------------------------------------------------------
+ * FormatSampleLine
+ *
+ *    Formats one averaged reading as read by EllipData.py.
+ *
+ * Parameters:
+ *    char *line  - Output buffer
+ *    int size    - Size of the output buffer
+ *    the remaining parameters are the values written to the line
+ *
+ * Returns: Length of the line
+ -----------------------------------------------------------------------------*/
+int FormatSampleLine(char *line, int size, uint32_t timeMs, double levelX,
+                     double levelY, double voltageX, double voltageY,
+                     double voltageSum) {
+    int length = 0;
+    AppendUnsigned(line, size, length, timeMs);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, levelX, 3);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, levelY, 3);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, voltageX, 3);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, voltageY, 3);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, voltageSum, 3);
+    return Finish(size, length);
+}
+
+/*------------------------------------------------------------------------------
+ * FormatSpectrumLine
+ *
+ *    Formats the averaged spectrum of one axis as
+ *    SPEC,Time_ms,Axis,BinWidth_mHz,Notch1_mHz,Notch2_mHz,A0,A1,...
+ *    Each amplitude (in microvolts) is the largest of spectrumBinsPerValue
+ *    neighbouring FFT bins. A notch frequency of 0 means the notch is off.
+ *
+ * Parameters:
+ *    char *line                      - Output buffer
+ *    int size                        - Size of the output buffer
+ *    uint32_t timeMs                 - Time stamp for the line
+ *    char axis                       - 'X' or 'Y'
+ *    const VibrationChannel &channel - Axis to report
+ *
+ * Returns: Length of the line
+ -----------------------------------------------------------------------------*/
+int FormatSpectrumLine(char *line, int size, uint32_t timeMs, char axis,
+                       const VibrationChannel &channel) {
+    char axisText[2] = {axis, '\0'};
+    int length = 0;
+    AppendText(line, size, length, "SPEC,");
+    AppendUnsigned(line, size, length, timeMs);
+    AppendText(line, size, length, ",");
+    AppendText(line, size, length, axisText);
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length,
+                   (unsigned long)(channel.BinHz() * spectrumBinsPerValue * 1000.0f + 0.5f));
+    for (int n = 0; n < maxNotches; n++) {
+        AppendText(line, size, length, ",");
+        AppendUnsigned(line, size, length,
+                       (unsigned long)(channel.Notch(n).CenterHz() * 1000.0f + 0.5f));
+    }
+    for (int bin = 0; bin < fftSize / 2; bin += spectrumBinsPerValue) {
+        uint32_t amplitude = 0;
+        for (int i = 0; i < spectrumBinsPerValue; i++) {
+            uint32_t value = channel.AmplitudeUv(bin + i);
+            if (value > amplitude) {
+                amplitude = value;
+            }
+        }
+        AppendText(line, size, length, ",");
+        AppendUnsigned(line, size, length, amplitude);
+    }
+    return Finish(size, length);
+}
+
+/*------------------------------------------------------------------------------
+ * FormatCalibrationHeader
+ *
+ *    Formats the PSD calibration map layout as
+ *    CAL,Size,uStart,uSpacing,vStart,vSpacing,mmPerStepX,mmPerStepY
+ *    It is followed by one FormatCalibrationRow line per map row.
+ *
+ * Parameters:
+ *    char *line                     - Output buffer
+ *    int size                       - Size of the output buffer
+ *    const PsdCalibrationData &map  - Map to report
+ *
+ * Returns: Length of the line
+ -----------------------------------------------------------------------------*/
+int FormatCalibrationHeader(char *line, int size, const PsdCalibrationData &map) {
+    int length = 0;
+    AppendText(line, size, length, "CAL,");
+    AppendUnsigned(line, size, length, map.size);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, map.uStart, 6);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, map.uSpacing, 6);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, map.vStart, 6);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, map.vSpacing, 6);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, map.mmPerStepX, 8);
+    AppendText(line, size, length, ",");
+    AppendFixed(line, size, length, map.mmPerStepY, 8);
+    return Finish(size, length);
+}
+
+/*------------------------------------------------------------------------------
+ * FormatCalibrationRow
+ *
+ *    Formats one row of the calibration map as
+ *    CALROW,Row,StepsX0,StepsY0,StepsX1,StepsY1,...
+ *
+ * Parameters:
+ *    char *line                     - Output buffer
+ *    int size                       - Size of the output buffer
+ *    const PsdCalibrationData &map  - Map to report
+ *    int row                        - Row (v index) to format
+ *
+ * Returns: Length of the line
+ -----------------------------------------------------------------------------*/
+int FormatCalibrationRow(char *line, int size, const PsdCalibrationData &map, int row) {
+    int length = 0;
+    AppendText(line, size, length, "CALROW,");
+    AppendUnsigned(line, size, length, row);
+    for (int i = 0; i < map.size; i++) {
+        AppendText(line, size, length, ",");
+        AppendSigned(line, size, length, map.stepsX[row][i]);
+        AppendText(line, size, length, ",");
+        AppendSigned(line, size, length, map.stepsY[row][i]);
+    }
+    return Finish(size, length);
+}
+
+/*------------------------------------------------------------------------------
+ * FormatHoldLine
+ *
+ *    Formats the motor hold statistics of one axis as
+ *    HOLD,Time_ms,Axis,Duty_permille,Wakes,CorrectionWakes,MeanLatency_us,MaxLatency_us,Timeouts
+ *    The latencies only count wakes that a correction had to wait for.
+ *    Timeouts counts wakes where HLFB did not assert in time.
+ *
+ * Parameters:
+ *    char *line             - Output buffer
+ *    int size               - Size of the output buffer
+ *    uint32_t timeMs        - Time stamp for the line
+ *    char axis              - 'X' or 'Y'
+ *    const AxisHold &hold   - Axis to report
+ *
+ * Returns: Length of the line
+ -----------------------------------------------------------------------------*/
+int FormatHoldLine(char *line, int size, uint32_t timeMs, char axis, const AxisHold &hold) {
+    char axisText[2] = {axis, '\0'};
+    int length = 0;
+    AppendText(line, size, length, "HOLD,");
+    AppendUnsigned(line, size, length, timeMs);
+    AppendText(line, size, length, ",");
+    AppendText(line, size, length, axisText);
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length, hold.DutyPermille(timeMs));
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length, hold.Wakes());
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length, hold.CorrectionWakes());
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length, hold.MeanLatencyUs());
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length, hold.MaxLatencyUs());
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length, hold.Timeouts());
+    return Finish(size, length);
+}
+
+/*------------------------------------------------------------------------------
+ * FormatModeLine
+ *
+ *    Formats a leveling regime change as MODE,Time_ms,Regime,DriftRate_uV_per_s
+ *
+ * Parameters:
+ *    char *line          - Output buffer
+ *    int size            - Size of the output buffer
+ *    uint32_t timeMs     - Time stamp for the line
+ *    const char *regime  - Name of the new regime
+ *    double driftRate    - Measured drift rate in V/s
+ *
+ * Returns: Length of the line
+ -----------------------------------------------------------------------------*/
+int FormatModeLine(char *line, int size, uint32_t timeMs, const char *regime, double driftRate) {
+    int length = 0;
+    AppendText(line, size, length, "MODE,");
+    AppendUnsigned(line, size, length, timeMs);
+    AppendText(line, size, length, ",");
+    AppendText(line, size, length, regime);
+    AppendText(line, size, length, ",");
+    AppendUnsigned(line, size, length, (unsigned long)(driftRate * 1.0E6 + 0.5));
+    return Finish(size, length);
+}
@@ -0,0 +1,40 @@
+/*==========================================================
+; File Name: Telemetry.h
+;
+; Description:
+; Formats the lines sent over the serial port. Sample lines keep the
+; "Time_ms,LevelX,LevelY,inputVoltageX,inputVoltageY,inputVoltageSUM"
+; layout read by EllipData.py. All other lines start with a tag
+; (for example "SPEC") so the logger can tell them apart.
+;
+; Only integer formatting is used because the embedded printf does not
+; include floating point support.
+;
+;========================================================== */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+class VibrationChannel;
+struct PsdCalibrationData;
+class AxisHold;
+
+// Large enough for the longest line (a spectrum line)
+const int telemetryLineSize = 768;
+// Spectrum bins are combined in groups of this size before being sent
+const int spectrumBinsPerValue = 2;
+
+int FormatSampleHeader(char *line, int size);
+int FormatSampleLine(char *line, int size, uint32_t timeMs, double levelX,
+                     double levelY, double voltageX, double voltageY,
+                     double voltageSum);
+int FormatSpectrumLine(char *line, int size, uint32_t timeMs, char axis,
+                       const VibrationChannel &channel);
+int FormatCalibrationHeader(char *line, int size, const PsdCalibrationData &map);
+int FormatCalibrationRow(char *line, int size, const PsdCalibrationData &map, int row);
+int FormatHoldLine(char *line, int size, uint32_t timeMs, char axis, const AxisHold &hold);
+int FormatModeLine(char *line, int size, uint32_t timeMs, const char *regime, double driftRate);
+
+#endif // TELEMETRY_H
@@ -0,0 +1,433 @@
+/*==========================================================
+; File Name: VibrationAnalysis.cpp
+;
+; Description:
+; Fixed-point FFT, peak tracking and notch filters for the PSD X/Y
+; signals. The FFT works on packed Q15 complex values (real part in the
+; low half-word, imaginary part in the high half-word) so that each
+; butterfly maps onto the Cortex-M4 DSP instructions SMUSD, SMUADX,
+; SHADD16 and SHSUB16. Every stage halves its output to prevent overflow
+; and the window is block scaled before the transform to keep precision.
+; When built for a PC the same operations are done in plain C++.
+;
+;========================================================== */
+
+#include "VibrationAnalysis.h"
+#include <math.h>
+
+static const float pi = 3.14159265f;
+
+static bool tablesReady = false;
+static int16_t hannWindow[fftSize];  // Q15
+static int32_t twiddle[fftSize / 2]; // packed Q15 exp(-j*2*pi*k/N)
+static uint8_t bitReverse[fftSize];
+static int32_t fftBuffer[fftSize];   // shared by both axes
+
+
+/*------------------------------------------------------------------------------
+ * Packed Q15 helpers
+ *
+ *    On the Cortex-M4 these are single DSP instructions. On other targets
+ *    they are emulated with the same rounding behavior.
+ -----------------------------------------------------------------------------*/
+static inline int32_t Pack(int32_t re, int32_t im) {
+    return (int32_t)(((uint32_t)(uint16_t)im << 16) | (uint16_t)re);
+}
+
+static inline int16_t Re(int32_t x) { return (int16_t)(x & 0xFFFF); }
+static inline int16_t Im(int32_t x) { return (int16_t)((uint32_t)x >> 16); }
+
+#if defined(__ARM_FEATURE_DSP)
+
+static inline int32_t Smusd(int32_t a, int32_t b) {
+    int32_t r;
+    __asm__ ("smusd %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+
+static inline int32_t Smuadx(int32_t a, int32_t b) {
+    int32_t r;
+    __asm__ ("smuadx %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+
+static inline int32_t Smuad(int32_t a, int32_t b) {
+    int32_t r;
+    __asm__ ("smuad %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+
+static inline int32_t Shadd16(int32_t a, int32_t b) {
+    int32_t r;
+    __asm__ ("shadd16 %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+
+static inline int32_t Shsub16(int32_t a, int32_t b) {
+    int32_t r;
+    __asm__ ("shsub16 %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+
+#else
+
+static inline int32_t Smusd(int32_t a, int32_t b) {
+    return (int32_t)Re(a) * Re(b) - (int32_t)Im(a) * Im(b);
+}
+
+static inline int32_t Smuadx(int32_t a, int32_t b) {
+    return (int32_t)Re(a) * Im(b) + (int32_t)Im(a) * Re(b);
+}
+
+static inline int32_t Smuad(int32_t a, int32_t b) {
+    return (int32_t)Re(a) * Re(b) + (int32_t)Im(a) * Im(b);
+}
+
+static inline int32_t Shadd16(int32_t a, int32_t b) {
+    return Pack((Re(a) + Re(b)) >> 1, (Im(a) + Im(b)) >> 1);
+}
+
+static inline int32_t Shsub16(int32_t a, int32_t b) {
+    return Pack((Re(a) - Re(b)) >> 1, (Im(a) - Im(b)) >> 1);
+}
+
+#endif
+
+// Q15 complex multiply x * w
+static inline int32_t ComplexMul(int32_t x, int32_t w) {
+    return Pack(Smusd(x, w) >> 15, Smuadx(x, w) >> 15);
+}
+
+
+/*------------------------------------------------------------------------------
+ * BuildTables
+ *
+ *    Fills the Hann window, twiddle factor and bit reversal tables the first
+ *    time a channel is initialized.
+ -----------------------------------------------------------------------------*/
+static void BuildTables() {
+    if (tablesReady) {
+        return;
+    }
+    for (int i = 0; i < fftSize; i++) {
+        hannWindow[i] = (int16_t)(32767.0f * 0.5f * (1.0f - cosf(2.0f * pi * i / fftSize)));
+        uint8_t reversed = 0;
+        for (int bit = 0; bit < fftBits; bit++) {
+            if (i & (1 << bit)) {
+                reversed |= 1 << (fftBits - 1 - bit);
+            }
+        }
+        bitReverse[i] = reversed;
+    }
+    for (int k = 0; k < fftSize / 2; k++) {
+        float angle = 2.0f * pi * k / fftSize;
+        twiddle[k] = Pack((int32_t)(32767.0f * cosf(angle)), (int32_t)(-32767.0f * sinf(angle)));
+    }
+    tablesReady = true;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Fft
+ *
+ *    In-place radix-2 decimation in time FFT of fftBuffer. The input must
+ *    already be in bit reversed order. The result is scaled by 1/fftSize.
+ -----------------------------------------------------------------------------*/
+static void Fft() {
+    for (int half = 1; half < fftSize; half <<= 1) {
+        int step = fftSize / (2 * half);
+        for (int start = 0; start < fftSize; start += 2 * half) {
+            for (int k = 0; k < half; k++) {
+                int32_t *top = &fftBuffer[start + k];
+                int32_t *bottom = top + half;
+                int32_t t = ComplexMul(*bottom, twiddle[k * step]);
+                int32_t a = *top;
+                *top = Shadd16(a, t);
+                *bottom = Shsub16(a, t);
+            }
+        }
+    }
+}
+
+
+NotchFilter::NotchFilter()
+    : active(false), centerHz(0), b0(1), b1(0), b2(0), a1(0), a2(0),
+      s1(0), s2(0), lastOutput(0) {}
+
+/*------------------------------------------------------------------------------
+ * NotchFilter::Configure
+ *
+ *    Computes the biquad coefficients for a notch at centerHz and starts the
+ *    filter from the last output so retuning does not cause a step.
+ *
+ * Parameters:
+ *    float center       - Frequency to remove, in Hz
+ *    float bandwidthHz  - -3dB width of the notch
+ *    float sampleRate   - Rate Update() is called at, in Hz
+ -----------------------------------------------------------------------------*/
+void NotchFilter::Configure(float center, float bandwidthHz, float sampleRate) {
+    float w0 = 2.0f * pi * center / sampleRate;
+    float q = center / bandwidthHz;
+    float alpha = sinf(w0) / (2.0f * q);
+    float a0 = 1.0f + alpha;
+
+    b0 = 1.0f / a0;
+    b1 = -2.0f * cosf(w0) / a0;
+    b2 = 1.0f / a0;
+    a1 = b1;
+    a2 = (1.0f - alpha) / a0;
+
+    centerHz = center;
+    active = true;
+    Settle(lastOutput);
+}
+
+void NotchFilter::Disable() {
+    active = false;
+    centerHz = 0;
+}
+
+float NotchFilter::Update(float input) {
+    if (!active) {
+        lastOutput = input;
+        return input;
+    }
+    float y = b0 * input + s1;
+    s1 = b1 * input - a1 * y + s2;
+    s2 = b2 * input - a2 * y;
+    lastOutput = y;
+    return y;
+}
+
+// Sets the filter state as if "value" had been the input for a long time
+void NotchFilter::Settle(float value) {
+    s2 = (b2 - a2) * value;
+    s1 = (b1 - a1) * value + s2;
+}
+
+
+VibrationChannel::VibrationChannel()
+    : voltsPerCount(0), fill(0), spectrumValid(false), output(0) {
+    for (int i = 0; i < maxNotches; i++) {
+        missedWindows[i] = 0;
+    }
+}
+
+void VibrationChannel::Init(float scale) {
+    BuildTables();
+    voltsPerCount = scale;
+    fill = 0;
+    spectrumValid = false;
+}
+
+/*------------------------------------------------------------------------------
+ * VibrationChannel::Update
+ *
+ *    Stores a raw ADC reading in the FFT window and passes its voltage
+ *    through the notch filters.
+ *
+ * Parameters:
+ *    int16_t adcCount  - Raw ADC reading
+ *
+ * Returns: The notch filtered voltage
+ -----------------------------------------------------------------------------*/
+float VibrationChannel::Update(int16_t adcCount) {
+    if (fill < fftSize) {
+        window[fill++] = adcCount;
+    }
+    float value = adcCount * voltsPerCount;
+    for (int i = 0; i < maxNotches; i++) {
+        value = notches[i].Update(value);
+    }
+    output = value;
+    return value;
+}
+
+void VibrationChannel::Restart() {
+    fill = 0;
+}
+
+/*------------------------------------------------------------------------------
+ * VibrationChannel::Analyze
+ *
+ *    Removes the mean from the full window, block scales it to use the Q15
+ *    range, applies the Hann window and runs the FFT. The bin powers are
+ *    converted back to counts^2 and averaged into the running spectrum,
+ *    then the notches are retuned to the dominant peaks.
+ -----------------------------------------------------------------------------*/
+void VibrationChannel::Analyze() {
+    int32_t sum = 0;
+    for (int i = 0; i < fftSize; i++) {
+        sum += window[i];
+    }
+    int32_t mean = sum / fftSize;
+
+    int32_t maxDeviation = 0;
+    for (int i = 0; i < fftSize; i++) {
+        int32_t deviation = window[i] - mean;
+        if (deviation < 0) {
+            deviation = -deviation;
+        }
+        if (deviation > maxDeviation) {
+            maxDeviation = deviation;
+        }
+    }
+    int shift = 0;
+    while (shift < 14 && (maxDeviation << (shift + 1)) < 16384) {
+        shift++;
+    }
+
+    for (int i = 0; i < fftSize; i++) {
+        int32_t value = (window[i] - mean) << shift;
+        value = (value * hannWindow[i]) >> 15;
+        fftBuffer[bitReverse[i]] = Pack(value, 0);
+    }
+    Fft();
+
+    for (int k = 0; k < fftSize / 2; k++) {
+        float binPower = ldexpf((float)(uint32_t)Smuad(fftBuffer[k], fftBuffer[k]), -2 * shift);
+        if (spectrumValid) {
+            power[k] += 0.25f * (binPower - power[k]);
+        }
+        else {
+            power[k] = binPower;
+        }
+    }
+    spectrumValid = true;
+    fill = 0;
+
+    float peakHz[maxNotches];
+    int peakCount = FindPeaks(peakHz, maxNotches);
+    RetuneNotches(peakHz, peakCount);
+}
+
+/*------------------------------------------------------------------------------
+ * VibrationChannel::AmplitudeUv
+ *
+ *    Converts an averaged bin power into a sine amplitude. The scaled FFT of
+ *    a Hann windowed sine of amplitude A has a peak of A/4.
+ -----------------------------------------------------------------------------*/
+uint32_t VibrationChannel::AmplitudeUv(int bin) const {
+    if (!spectrumValid) {
+        return 0;
+    }
+    return (uint32_t)(4.0f * sqrtf(power[bin]) * voltsPerCount * 1.0E6f + 0.5f);
+}
+
+/*------------------------------------------------------------------------------
+ * VibrationChannel::FindPeaks
+ *
+ *    Finds the strongest local maxima of the averaged spectrum that are above
+ *    minVibrationHz and peakToFloorRatio times the mean power. The peak
+ *    frequency is refined with a parabolic fit over the neighbouring bins.
+ *
+ * Parameters:
+ *    float *peakHz  - Receives the peak frequencies, lowest first
+ *    int maxPeaks   - Size of peakHz
+ *
+ * Returns: Number of peaks found
+ -----------------------------------------------------------------------------*/
+int VibrationChannel::FindPeaks(float *peakHz, int maxPeaks) const {
+    int firstBin = (int)ceilf(minVibrationHz / BinHz());
+    if (firstBin < 2) {
+        firstBin = 2; // bins 0 and 1 hold the leftover DC leakage
+    }
+    const int lastBin = fftSize / 2 - 1;
+
+    float noiseFloor = 0;
+    for (int k = firstBin; k <= lastBin; k++) {
+        noiseFloor += power[k];
+    }
+    noiseFloor /= (lastBin - firstBin + 1);
+    if (noiseFloor <= 0) {
+        return 0;
+    }
+
+    int bins[maxNotches];
+    int count = 0;
+    for (int k = firstBin; k < lastBin; k++) {
+        if (power[k] <= power[k - 1] || power[k] < power[k + 1] ||
+            power[k] < noiseFloor * peakToFloorRatio) {
+            continue;
+        }
+        // Keep the strongest peaks, sorted by power
+        int slot = count < maxPeaks ? count++ : maxPeaks;
+        while (slot > 0 && power[bins[slot - 1]] < power[k]) {
+            if (slot < maxPeaks) {
+                bins[slot] = bins[slot - 1];
+            }
+            slot--;
+        }
+        if (slot < maxPeaks) {
+            bins[slot] = k;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        int k = bins[i];
+        float left = power[k - 1], center = power[k], right = power[k + 1];
+        float denominator = left - 2.0f * center + right;
+        float offset = denominator != 0 ? 0.5f * (left - right) / denominator : 0;
+        peakHz[i] = (k + offset) * BinHz();
+    }
+    // Lowest frequency first so notches keep a stable order
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && peakHz[j] < peakHz[j - 1]; j--) {
+            float swap = peakHz[j];
+            peakHz[j] = peakHz[j - 1];
+            peakHz[j - 1] = swap;
+        }
+    }
+    return count;
+}
+
+/*------------------------------------------------------------------------------
+ * VibrationChannel::RetuneNotches
+ *
+ *    Matches the detected peaks to the active notches. A notch is only moved
+ *    when its peak drifts by more than half a bin, and is only released after
+ *    notchReleaseWindows windows without a peak, so the filters do not keep
+ *    switching on noise. Unmatched peaks take a free notch.
+ -----------------------------------------------------------------------------*/
+void VibrationChannel::RetuneNotches(const float *peakHz, int peakCount) {
+    bool claimed[maxNotches] = {};
+
+    for (int n = 0; n < maxNotches; n++) {
+        if (!notches[n].Active()) {
+            continue;
+        }
+        int nearest = -1;
+        float nearestDistance = 2.0f * BinHz();
+        for (int p = 0; p < peakCount; p++) {
+            float distance = fabsf(peakHz[p] - notches[n].CenterHz());
+            if (!claimed[p] && distance <= nearestDistance) {
+                nearest = p;
+                nearestDistance = distance;
+            }
+        }
+        if (nearest < 0) {
+            if (++missedWindows[n] >= notchReleaseWindows) {
+                notches[n].Disable();
+            }
+            continue;
+        }
+        claimed[nearest] = true;
+        missedWindows[n] = 0;
+        if (nearestDistance > 0.5f * BinHz()) {
+            notches[n].Configure(peakHz[nearest], notchBandwidthHz, vibrationSampleRate);
+        }
+    }
+
+    for (int p = 0; p < peakCount; p++) {
+        if (claimed[p]) {
+            continue;
+        }
+        for (int n = 0; n < maxNotches; n++) {
+            if (!notches[n].Active()) {
+                notches[n].Configure(peakHz[p], notchBandwidthHz, vibrationSampleRate);
+                missedWindows[n] = 0;
+                break;
+            }
+        }
+    }
+}
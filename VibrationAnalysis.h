@@ -0,0 +1,106 @@
+/*==========================================================
+; File Name: VibrationAnalysis.h
+;
+; Description:
+; Spectral analysis and notch filtering of the raw PSD X/Y signals.
+; Each axis collects a window of raw ADC readings at a fixed rate, runs
+; a fixed-point (Q15) FFT over it and looks for periodic vibration from
+; the pumps and heated stage. Dominant peaks are tracked and removed by
+; a bank of notch filters that sit ahead of the leveling average.
+;
+; This file does not depend on ClearCore so it can also be built on a PC.
+;
+;========================================================== */
+
+#ifndef VIBRATION_ANALYSIS_H
+#define VIBRATION_ANALYSIS_H
+
+#include <stdint.h>
+
+// Number of raw samples per FFT window (must be a power of two)
+const int fftSize = 256;
+const int fftBits = 8;
+// Time between raw vibration samples, 2000us = 500Hz sampling
+const uint32_t vibrationSamplePeriodUs = 2000;
+const float vibrationSampleRate = 1.0E6f / vibrationSamplePeriodUs;
+// Number of notch filters available per axis
+const int maxNotches = 2;
+// Peaks below this frequency are treated as real tilt, not vibration
+const float minVibrationHz = 4.0f;
+// A peak must be this many times above the average spectrum power
+const float peakToFloorRatio = 10.0f;
+// Width of each notch, about two FFT bins
+const float notchBandwidthHz = 4.0f;
+// Windows without a matching peak before a notch is switched off
+const int notchReleaseWindows = 4;
+
+
+/*------------------------------------------------------------------------------
+ * NotchFilter
+ *
+ *    Second order (biquad) notch in transposed direct form II. It has unity
+ *    gain at DC so the slow tilt signal passes through unchanged.
+ -----------------------------------------------------------------------------*/
+class NotchFilter {
+public:
+    NotchFilter();
+
+    // Sets the notch center frequency, the filter keeps its current output
+    void Configure(float center, float bandwidthHz, float sampleRate);
+    void Disable();
+    float Update(float input);
+
+    bool Active() const { return active; }
+    float CenterHz() const { return centerHz; }
+
+private:
+    void Settle(float value);
+
+    bool active;
+    float centerHz;
+    float b0, b1, b2, a1, a2;
+    float s1, s2;
+    float lastOutput;
+};
+
+
+/*------------------------------------------------------------------------------
+ * VibrationChannel
+ *
+ *    Raw sample window, averaged spectrum and notch filters for one PSD axis.
+ *    Update() is called for every raw ADC reading and returns the filtered
+ *    voltage. Once WindowReady() is true, Analyze() runs the FFT, updates the
+ *    averaged spectrum and retunes the notches.
+ -----------------------------------------------------------------------------*/
+class VibrationChannel {
+public:
+    VibrationChannel();
+
+    void Init(float voltsPerCount);
+    float Update(int16_t adcCount);
+    // Drops a partially filled window (used after a gap in sampling)
+    void Restart();
+    bool WindowReady() const { return fill == fftSize; }
+    void Analyze();
+
+    float Output() const { return output; }
+    float BinHz() const { return vibrationSampleRate / fftSize; }
+    // Averaged amplitude of a spectrum bin in microvolts
+    uint32_t AmplitudeUv(int bin) const;
+    const NotchFilter &Notch(int index) const { return notches[index]; }
+
+private:
+    int FindPeaks(float *peakHz, int maxPeaks) const;
+    void RetuneNotches(const float *peakHz, int peakCount);
+
+    float voltsPerCount;
+    int16_t window[fftSize];
+    int fill;
+    bool spectrumValid;
+    float power[fftSize / 2]; // averaged power in counts^2
+    NotchFilter notches[maxNotches];
+    int missedWindows[maxNotches];
+    float output;
+};
+
+#endif // VIBRATION_ANALYSIS_H